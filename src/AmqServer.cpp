@@ -3,62 +3,109 @@
 #include "Log.h"
 #include "Message.h"
 #include "Server.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+#include "Backoff.h"
+#include "Metrics.h"
 #include "AmqServer.h"
 #include "DateUtil.h"
 
 #define QUEUE_LIMIT 8192
-
-Frame::Frame(MessageRef message)
+#define PRODUCER_WINDOW_SIZE (1024 * 1024)
+
+// First wait before reconnecting, in microseconds
+#define BACKOFF_MIN 250000
+
+static Histogram sendLatency("mllp_broker_send_seconds", "",
+	"Time for the broker to take a message");
+static Counter connects("mllp_broker_connects_total", "",
+	"Broker connections made");
+static Counter connectFailures("mllp_broker_connect_failures_total", "",
+	"Broker connection attempts that failed");
+
+// Only a few errors say anything about the message itself.  Lost
+// connections, broker resource limits and permissions fail every message
+// alike, so they're plain failures and the sender just tries again later.
+static bool isRefusal(cms::CMSException const &ex)
 {
-	this->message= message;
-	this->success= false;
-	this->abandoned= false;
+	return (dynamic_cast<cms::MessageFormatException const *>(&ex) != NULL) ||
+		(dynamic_cast<cms::MessageNotWriteableException const *>(&ex) != NULL);
 }
 
-bool Frame::await(int timeout) {
-	std::unique_lock<std::mutex> lock(completeLock);
-
-	if (completeWake.wait_for(lock,
-		std::chrono::seconds(timeout)) == std::cv_status::timeout)
-	{
-		Log::log(LOG_WARNING, "Timeout waiting for call frame");
-
-		abandoned= true;
+// Refusals are reported as such so the sender can tell a bad message from
+// an outage
+static void answer(FrameRef frame, bool success, bool refused)
+{
+	if (refused) {
+		frame->reject();
+	} else {
+		frame->complete(success);
 	}
-
-	return success;
-}
-
-void Frame::complete(bool success) {
-	this->success= success;
-	completeWake.notify_one();
 }
 
 AmqServer::AmqServer(
 	char const *brokerUri, char const *user, char const *pass,
 	char const *queueName,
-	bool jsonEnvelope)
+	bool jsonEnvelope,
+	Options const &options)
+	: sendQueue(QUEUE_LIMIT)
 {
 	this->brokerUri= brokerUri;
 	this->user= user;
 	this->pass= pass;
 	this->queueName= queueName;
 	this->jsonEnvelope= jsonEnvelope;
+	this->options= options;
 
-	factory= 
+	activemq::core::ActiveMQConnectionFactory *amqFactory=
 		new activemq::core::ActiveMQConnectionFactory(brokerUri);
 
-	connection= NULL;
-	session= NULL;
+	if (options.asyncWindow > 0) {
+		// Let the broker hold back an async producer that gets too far
+		// ahead of it, on top of our own limit on frames in flight.
+		amqFactory->setProducerWindowSize(PRODUCER_WINDOW_SIZE);
+
+		sendSlots.resize(options.asyncWindow);
+		for (SendSlot &slot : sendSlots) {
+			slot.done= false;
+			slot.success= false;
+			slot.refused= false;
+			slot.sequence= 0;
+			slot.callback= NULL;
+		}
+	}
+	sendSlotHead= 0;
+	sendSlotCount= 0;
+	sendSequence= 0;
+
+	factory= amqFactory;
+
+	channel= NULL;
+	standby= NULL;
+	standbyThread= NULL;
+
+	connected= false;
 }
 
 AmqServer::~AmqServer()
 {
-	sendQueue.clear();
+	FrameRef frame;
+	while (sendQueue.pop(frame)) {
+		frame->complete(false);
+	}
+
+	for (SendSlot &slot : sendSlots) {
+		delete slot.callback;
+	}
+	for (SendCallback *callback : retiredCallbacks) {
+		delete callback;
+	}
+
 	delete factory;
 }
 
-void AmqServer::onException(const cms::CMSException &ex)
+void AmqServer::Channel::onException(const cms::CMSException &ex)
 {
 	std::string err= ex.getMessage();
 
@@ -66,59 +113,103 @@ void AmqServer::onException(const cms::CMSException &ex)
 		"CMS Exception on ExceptionListener: %s",
 		err.c_str());
 
-	error= true;
-	sendQueueCond.notify_one();
+	server->fail(failed);
 }
 
-bool AmqServer::queue(MessageRef message)
+void AmqServer::fail(std::atomic<bool> &flag)
 {
-	FrameRef frame= std::make_shared<Frame>(message);
-
+	// Set under the slot lock so a sender waiting for room in the window
+	// can't miss it - the broker may never answer what's outstanding.
 	{
-		std::lock_guard<std::mutex> lock(sendQueueLock);
-		sendQueue.push_back(frame);
+		std::lock_guard<std::mutex> permit(sendSlotLock);
+		flag= true;
+		sendSlotWake.notify_all();
 	}
 
-	sendQueueCond.notify_one();
+	sendQueueSignal.notify();
+}
 
-	return frame->await(10);
+bool AmqServer::queue(MessageRef message)
+{
+	return submit(message)->await(10);
 }
 
-bool AmqServer::connect()
+FrameRef AmqServer::submit(MessageRef message,
+	std::function<void(bool success)> done)
 {
-	bool rval= false;
+	FrameRef frame= Frame::Create(message, done);
+
+	if (!connected) {
+		frame->complete(false);
+	} else if (!sendQueue.push(frame)) {
+		Log::log(LOG_WARNING,
+			"Send queue is full with %d messages", QUEUE_LIMIT);
+
+		frame->complete(false);
+	} else {
+		sendQueueSignal.notify();
+	}
+
+	return frame;
+}
+
+AmqServer::Channel *AmqServer::connect()
+{
+	Channel *channel= new Channel();
+	channel->server= this;
+	channel->connection= NULL;
+	channel->session= NULL;
+	channel->destination= NULL;
+	channel->producer= NULL;
+	channel->textMessage= NULL;
+	channel->failed= false;
 
 	try {
-		connection= factory->createConnection(user, pass);
+		channel->connection= factory->createConnection(user, pass);
 
 		// Create the session for pushing messages
-		session= connection->createSession(
-			cms::Session::CLIENT_ACKNOWLEDGE);
+		channel->session= channel->connection->createSession(
+			(options.batchSize > 1) ?
+				cms::Session::SESSION_TRANSACTED :
+				cms::Session::CLIENT_ACKNOWLEDGE);
+
+		channel->connection->setExceptionListener(channel);
+
+		// Everything goes to the same queue, so set up the producer once
+		// here instead of on every send.
+		channel->destination= channel->session->createQueue(
+			queueName.c_str());
+		channel->producer= channel->session->createProducer(
+			channel->destination);
+		channel->textMessage= channel->session->createTextMessage();
 
-		connection->setExceptionListener(this);
+		channel->connection->start();
 
-		connection->start();
+		connects.add();
 
 		Log::log(LOG_INFO,
 			"Connected to MQ server");
-
-		rval= true;
 	} catch (const cms::CMSException& ex) {
 		auto err= ex.getMessage();
 
 		Log::log(LOG_ERROR,
 			"CMS Exception connecting: %s",
 			err.c_str());
+
+		connectFailures.add();
+
+		disconnect(channel);
+		channel= NULL;
 	}
 
-	return rval;
+	return channel;
 }
 
-void AmqServer::disconnect()
+void AmqServer::disconnect(Channel *channel)
 {
 	try {
-		if (connection != NULL) {
-			connection->close();
+		if (channel->connection != NULL) {
+			channel->connection->close();
 		}
 	} catch (const cms::CMSException& ex2) {
 		auto err= ex2.getMessage();
@@ -128,19 +219,29 @@ void AmqServer::disconnect()
 				err.c_str());
 	}
 
-	if (session != NULL) {
-		delete session;
-		session= NULL;
+	if (channel->textMessage != NULL) {
+		delete channel->textMessage;
+	}
+	if (channel->producer != NULL) {
+		delete channel->producer;
+	}
+	if (channel->destination != NULL) {
+		delete channel->destination;
 	}
-	if (connection != NULL) {
-		delete connection;
-		connection= NULL;
+	if (channel->session != NULL) {
+		delete channel->session;
 	}
+	if (channel->connection != NULL) {
+		delete channel->connection;
+	}
+
+	delete channel;
 }
 
-bool AmqServer::send(FrameRef frame)
+bool AmqServer::send(FrameRef frame, bool &refused)
 {
 	bool rval= false;
+	refused= false;
 
 	if (frame->isAbandoned()) {
 		Log::log(LOG_INFO,
@@ -149,35 +250,198 @@ bool AmqServer::send(FrameRef frame)
 		return true;
 	}
 
-	cms::Destination *destination= NULL;
-	cms::MessageProducer *producer= NULL;
-	cms::TextMessage *message= NULL;
-
 	try {
-		destination= session->createQueue(queueName.c_str());
-		producer= session->createProducer(destination);
+		fillMessage(frame);
 
-		std::string timestamp= DateUtil::TimeToISO8601(
-			frame->getMessage()->getTimestamp());
+		uint64_t sentAt= Metrics::now();
+		channel->producer->send(channel->textMessage);
+		sendLatency.record(Metrics::now() - sentAt);
 
-		if (jsonEnvelope) {
-			Json::Value envelope= Json::objectValue;
-			envelope["message"]= frame->getMessage()->getData();
-			envelope["timestamp"]=  timestamp;
-			envelope["remoteHost"]= frame->getMessage()->getRemoteHost();
+		rval= true;
+	} catch (const cms::CMSException &e) {
+		std::string error= e.getMessage();
+
+		Log::log(LOG_ERROR,
+			"Error sending message: %s",
+			error.c_str());
 
-			std::string bodyString= Json::FastWriter().write(envelope);
-			message= session->createTextMessage(bodyString.c_str());
+		refused= isRefusal(e);
+	}
+
+	return rval;
+}
+
+void AmqServer::fillMessage(FrameRef frame)
+{
+	std::string timestamp= DateUtil::TimeToISO8601(
+		frame->getMessage()->getTimestamp());
+
+	cms::TextMessage *textMessage= channel->textMessage;
+
+	// The producer sends a copy, so the same message object can be
+	// refilled for the next one.
+	textMessage->clearProperties();
+
+	if (jsonEnvelope) {
+		Json::Value envelope= Json::objectValue;
+		envelope["message"]= Json::Value(
+			frame->getMessage()->getData(),
+			frame->getMessage()->getData() +
+				frame->getMessage()->getDataLen());
+		envelope["timestamp"]=  timestamp;
+		envelope["remoteHost"]= frame->getMessage()->getRemoteHost();
+
+		textMessage->setText(Json::FastWriter().write(envelope));
+	} else {
+		textMessage->setText(frame->getMessage()->getDataString());
+	}
+
+	textMessage->setStringProperty("MLLP-Timestamp", timestamp.c_str());
+	textMessage->setStringProperty("MLLP-RemoteHost",
+		frame->getMessage()->getRemoteHost());
+}
+
+void AmqServer::SendCallback::onSuccess()
+{
+	server->resolve(index, sequence, true, false);
+}
+
+void AmqServer::SendCallback::onException(const cms::CMSException &ex)
+{
+	std::string err= ex.getMessage();
+
+	Log::log(LOG_ERROR,
+		"Broker refused asynchronous send: %s",
+		err.c_str());
+
+	// A bad message doesn't mean the connection is
+	bool refused= isRefusal(ex);
+	if (server->resolve(index, sequence, false, refused) && !refused) {
+		server->fail(server->error);
+	}
+}
+
+bool AmqServer::resolve(size_t index, uint64_t sequence,
+	bool success, bool refused)
+{
+	std::lock_guard<std::mutex> permit(sendSlotLock);
+
+	// Already answered, or abandoned and maybe reused since
+	SendSlot *slot= &sendSlots[index];
+	if (slot->done || (slot->sequence != sequence)) {
+		return false;
+	}
+
+	sendLatency.record(Metrics::now() - slot->sentAt);
+
+	slot->done= true;
+	slot->success= success;
+	slot->refused= refused;
+
+	// Stamped as it's confirmed, even if it has to wait on the ones before
+	// it to be answered
+	if (success) {
+		slot->frame->getMessage()->mark(Message::CONFIRMED);
+	}
+
+	// Answer everything at the head of the window that's finished, so
+	// frames always complete in the order they were sent.
+
+	while (sendSlotCount > 0) {
+		SendSlot &head= sendSlots[sendSlotHead];
+		if (!head.done) {
+			break;
+		}
+
+		answer(head.frame, head.success, head.refused);
+		head.frame= nullptr;
+
+		sendSlotHead= (sendSlotHead + 1) % sendSlots.size();
+		sendSlotCount--;
+	}
+
+	sendSlotWake.notify_all();
+
+	return true;
+}
+
+void AmqServer::abandonSlots()
+{
+	// Called once the connection is gone.  Anything still in flight fails,
+	// and its callback is retired so that if the broker answers it anyway
+	// the answer can't land on a later send from the same slot.
+
+	std::lock_guard<std::mutex> permit(sendSlotLock);
+
+	while (sendSlotCount > 0) {
+		SendSlot &head= sendSlots[sendSlotHead];
+		if (head.done) {
+			answer(head.frame, head.success, head.refused);
 		} else {
-			message= session->createTextMessage(
-				frame->getMessage()->getData());
+			head.frame->complete(false);
+			head.done= true;
+
+			retiredCallbacks.push_back(head.callback);
+			head.callback= NULL;
+		}
+		head.frame= nullptr;
+
+		sendSlotHead= (sendSlotHead + 1) % sendSlots.size();
+		sendSlotCount--;
+	}
+
+	sendSlotWake.notify_all();
+}
+
+bool AmqServer::sendAsync(FrameRef frame)
+{
+	if (frame->isAbandoned()) {
+		Log::log(LOG_INFO,
+			"Ignoring abandoned frame");
+
+		return true;
+	}
+
+	SendCallback *callback= NULL;
+	{
+		std::unique_lock<std::mutex> permit(sendSlotLock);
+		while (run && !failing() && (sendSlotCount >= sendSlots.size())) {
+			sendSlotWake.wait(permit);
 		}
 
-		message->setStringProperty("MLLP-Timestamp", timestamp.c_str());
-		message->setStringProperty("MLLP-RemoteHost",
-			frame->getMessage()->getRemoteHost());
+		if (run && !failing()) {
+			size_t index= (sendSlotHead + sendSlotCount) % sendSlots.size();
+			SendSlot *slot= &sendSlots[index];
+			slot->frame= frame;
+			slot->done= false;
+			slot->success= false;
+			slot->refused= false;
+			slot->sequence= ++sendSequence;
+			slot->sentAt= Metrics::now();
+
+			if (slot->callback == NULL) {
+				slot->callback= new SendCallback();
+				slot->callback->server= this;
+				slot->callback->index= index;
+			}
+			slot->callback->sequence= slot->sequence;
+			callback= slot->callback;
+
+			sendSlotCount++;
+		}
+	}
+
+	if (callback == NULL) {
+		frame->complete(false);
+		return false;
+	}
+
+	bool rval= false;
+
+	try {
+		fillMessage(frame);
 
-		producer->send(message);
+		channel->producer->send(channel->textMessage, callback);
 
 		rval= true;
 	} catch (const cms::CMSException &e) {
@@ -186,73 +450,332 @@ bool AmqServer::send(FrameRef frame)
 		Log::log(LOG_ERROR,
 			"Error sending message: %s",
 			error.c_str());
+
+		// Only worth reconnecting over if it wasn't the message
+		rval= isRefusal(e);
+		resolve(callback->index, callback->sequence, false, rval);
 	}
 
-	if (message != NULL) {
-		delete message;
+	return rval;
+}
+
+void AmqServer::takeFrames(std::vector<FrameRef> &batch)
+{
+	size_t batchSize= (size_t)options.batchSize;
+
+	FrameRef frame;
+	if (!sendQueue.pop(frame)) {
+		int key= sendQueueSignal.prepare();
+		if (run && !failing() && !sendQueue.pop(frame)) {
+			sendQueueSignal.wait(key, -1);
+		}
+		sendQueueSignal.finish();
 	}
-	if (producer != NULL) {
-		delete producer;
+
+	if (frame) {
+		batch.push_back(std::move(frame));
 	}
-	if (destination != NULL) {
-		delete destination;
+
+	while ((batch.size() < batchSize) && sendQueue.pop(frame)) {
+		batch.push_back(std::move(frame));
+	}
+
+	if (!batch.empty() && (batch.size() < batchSize) &&
+		(options.batchDelay > 0))
+	{
+		// Give a burst a little time to fill out the transaction
+
+		auto deadline= std::chrono::steady_clock::now() +
+			std::chrono::microseconds(options.batchDelay);
+
+		while (run && !failing() && (batch.size() < batchSize)) {
+			if (sendQueue.pop(frame)) {
+				batch.push_back(std::move(frame));
+			} else {
+				long remaining=
+					std::chrono::duration_cast<std::chrono::microseconds>(
+						deadline - std::chrono::steady_clock::now()).count();
+				if (remaining <= 0) {
+					break;
+				}
+
+				int key= sendQueueSignal.prepare();
+				if (!sendQueue.pop(frame)) {
+					sendQueueSignal.wait(key, remaining);
+				} else {
+					batch.push_back(std::move(frame));
+				}
+				sendQueueSignal.finish();
+			}
+		}
+	}
+}
+
+bool AmqServer::sendBatch(std::vector<FrameRef> &batch)
+{
+	// Everything in the batch goes in one transaction, and nobody gets
+	// an answer until the commit does.  A message the broker refuses is
+	// taken out and the rest go again in a fresh transaction, so they
+	// don't fail along with it.
+
+	bool rval= false;
+	while (!batch.empty()) {
+		rval= true;
+
+		bool refused= false;
+		size_t index= 0;
+		for (; index < batch.size(); index++) {
+			if (!send(batch[index], refused)) {
+				rval= false;
+				break;
+			}
+		}
+
+		if (rval) {
+			try {
+				channel->session->commit();
+			} catch (const cms::CMSException &e) {
+				std::string error= e.getMessage();
+
+				Log::log(LOG_ERROR,
+					"Error committing batch of %d messages: %s",
+					(int)batch.size(), error.c_str());
+
+				rval= false;
+			}
+		}
+
+		if (!rval) {
+			try {
+				channel->session->rollback();
+			} catch (const cms::CMSException &e) {
+				std::string error= e.getMessage();
+
+				Log::log(LOG_ERROR,
+					"Error rolling back batch: %s",
+					error.c_str());
+
+				refused= false;
+			}
+		}
+
+		if (!refused) {
+			break;
+		}
+
+		batch[index]->reject();
+		batch.erase(batch.begin() + index);
+
+		// Nothing wrong with the connection if that was all of it
+		rval= true;
+	}
+
+	for (FrameRef frame : batch) {
+		if (rval) {
+			frame->getMessage()->mark(Message::CONFIRMED);
+		}
+		frame->complete(rval);
 	}
 
 	return rval;
 }
 
+void AmqServer::pause(long timeout)
+{
+	auto deadline= std::chrono::steady_clock::now() +
+		std::chrono::microseconds(timeout);
+
+	while (run) {
+		long remaining= std::chrono::duration_cast<std::chrono::microseconds>(
+			deadline - std::chrono::steady_clock::now()).count();
+		if (remaining <= 0) {
+			break;
+		}
+
+		// stop() wakes us through the send queue signal
+		int key= sendQueueSignal.prepare();
+		if (run) {
+			sendQueueSignal.wait(key, remaining);
+		}
+		sendQueueSignal.finish();
+	}
+}
+
 void AmqServer::runLoop()
 {
+	Backoff backoff(BACKOFF_MIN, options.maxBackoff * 1000000L);
+
 	while (run) {
 		error= false;
 
-		if (connect()) {
-			while (run && !error) {
-				FrameRef frame= nullptr;
-				{
-					std::unique_lock<std::mutex> lock(sendQueueLock);
-					if (!sendQueue.empty()) {
-						frame= sendQueue.front();
-						sendQueue.pop_front();
-					} else {
-						sendQueueCond.wait(lock);
-						if (!sendQueue.empty()) {
-							frame= sendQueue.front();
-							sendQueue.pop_front();
-						}
-					}
-				}
+		// A warmed up standby saves the connect and handshake
+		{
+			std::lock_guard<std::mutex> permit(standbyLock);
+			if ((standby != NULL) && !standby->failed) {
+				channel= standby;
+				standby= NULL;
+				standbyWake.notify_all();
+
+				Log::log(LOG_INFO, "Switching to standby connection");
+			}
+		}
+
+		if (channel == NULL) {
+			channel= connect();
+		}
+
+		if (channel == NULL) {
+			// Whatever was queued for the first attempt fails now
+			connected= false;
+
+			FrameRef frame;
+			while (sendQueue.pop(frame)) {
+				frame->complete(false);
+			}
 
-				if (frame) {
-					bool success= send(frame);
-					if (!success) {
+			long delay= backoff.next();
+
+			Log::log(LOG_WARNING,
+				"Broker unavailable - retrying in %ld ms", delay / 1000);
+
+			pause(delay);
+			continue;
+		}
+
+		backoff.reset();
+		connected= true;
+
+		std::vector<FrameRef> batch;
+
+		while (run && !failing()) {
+			batch.clear();
+			takeFrames(batch);
+
+			for (FrameRef frame : batch) {
+				frame->getMessage()->mark(Message::DEQUEUED);
+			}
+
+			if (options.batchSize > 1) {
+				if (!batch.empty() && !sendBatch(batch)) {
+					error= true;
+				}
+			} else if (options.asyncWindow > 0) {
+				for (FrameRef frame : batch) {
+					if (!sendAsync(frame)) {
 						error= true;
 					}
-					frame->complete(success);
 				}
+			} else if (!batch.empty()) {
+				FrameRef frame= batch.front();
+
+				bool refused;
+				bool success= send(frame, refused);
+				if (success) {
+					frame->getMessage()->mark(Message::CONFIRMED);
+				} else if (!refused) {
+					error= true;
+				}
+				answer(frame, success, refused);
 			}
 		}
 
+		// Fail new sends straight away until we're back
+		connected= false;
+
 		Log::log(LOG_INFO, "Tearing down connection");
-		disconnect();
+		disconnect(channel);
+		channel= NULL;
+		abandonSlots();
+
+		// Anything still waiting fails now rather than going out after the
+		// reconnect, ahead of whatever the sender is going to retry.
+		FrameRef frame;
+		while (sendQueue.pop(frame)) {
+			frame->complete(false);
+		}
+	}
+}
 
-		if (run) {
-			sleep(5);
+void AmqServer::standbyLoop()
+{
+	Backoff backoff(BACKOFF_MIN, options.maxBackoff * 1000000L);
+
+	std::unique_lock<std::mutex> permit(standbyLock);
+
+	while (run) {
+		if ((standby != NULL) && standby->failed) {
+			Log::log(LOG_WARNING, "Standby connection failed");
+
+			disconnect(standby);
+			standby= NULL;
 		}
+
+		if (standby != NULL) {
+			// Wait for it to be taken, or to fail
+			standbyWake.wait_for(permit, std::chrono::seconds(1));
+			continue;
+		}
+
+		permit.unlock();
+		Channel *fresh= connect();
+		permit.lock();
+
+		if (fresh != NULL) {
+			backoff.reset();
+			standby= fresh;
+		} else {
+			standbyWake.wait_for(permit,
+				std::chrono::microseconds(backoff.next()));
+		}
+	}
+
+	if (standby != NULL) {
+		disconnect(standby);
+		standby= NULL;
 	}
 }
 
-void AmqServer::start()
+bool AmqServer::start()
 {
+	sendQueueGauge.reset(new Gauge("mllp_send_queue_depth", "",
+		"Messages waiting for the broker sender",
+		[this]() { return (double)sendQueue.size(); }));
+
+	// Messages that come in while the first connection is made wait for
+	// it, rather than failing just because we've only just started
+	connected= true;
+
 	run= true;
 	thread= new std::thread(&AmqServer::runLoop, this);
+
+	if (options.standby) {
+		standbyThread= new std::thread(&AmqServer::standbyLoop, this);
+	}
+
+	return true;
 }
 
 void AmqServer::stop()
 {
 	run= false;
-	sendQueueCond.notify_one();
+	sendQueueSignal.notify();
+	{
+		std::lock_guard<std::mutex> permit(sendSlotLock);
+		sendSlotWake.notify_all();
+	}
 	thread->join();
 	delete thread;
-}
 
+	if (standbyThread != NULL) {
+		{
+			std::lock_guard<std::mutex> permit(standbyLock);
+			standbyWake.notify_all();
+		}
+
+		standbyThread->join();
+		delete standbyThread;
+		standbyThread= NULL;
+	}
+
+	sendQueueGauge.reset();
+}
@@ -1,64 +1,155 @@
 class Message;
 typedef std::shared_ptr<Message> MessageRef;
 
-class Frame {
-private:
-	MessageRef message;
-
-	std::mutex completeLock;
-	std::condition_variable completeWake;
-
-	bool abandoned;
-	bool success;
+class Server;
+class Gauge;
 
+class AmqServer : public Server {
 public:
-	Frame(MessageRef message);
+	struct Options {
+		Options()
+		{
+			batchSize= 1;
+			batchDelay= 0;
+			asyncWindow= 0;
+			maxBackoff= 60;
+			standby= false;
+		}
 
-	MessageRef getMessage() {
-		return message;
-	}
+		// Frames sent per transaction - 1 means no transactions
+		int batchSize;
 
-	bool isAbandoned() {
-		std::lock_guard<std::mutex> permit(completeLock);
-		return abandoned;
-	}
+		// Microseconds to wait for a batch to fill out
+		int batchDelay;
 
-	bool await(int timeout);
-	void complete(bool success);
-};
+		// Sends allowed in flight at once without waiting for the
+		// broker - 0 means every send waits
+		int asyncWindow;
 
-typedef std::shared_ptr<Frame> FrameRef;
+		// Longest wait between reconnect attempts, in seconds
+		int maxBackoff;
+
+		// Keep a second connection open and ready to take over
+		bool standby;
+	};
 
-class Server;
-class AmqServer : public Server, public cms::ExceptionListener {
 private:
+	// One broker connection, with everything we send through it built
+	// once up front and reused.
+	class Channel : public cms::ExceptionListener {
+	public:
+		AmqServer *server;
+
+		cms::Connection *connection;
+		cms::Session *session;
+		cms::Destination *destination;
+		cms::MessageProducer *producer;
+		cms::TextMessage *textMessage;
+
+		std::atomic<bool> failed;
+
+		virtual void onException(const cms::CMSException &ex) override;
+	};
+
+	// Hands the broker's answer back to the slot it was sent from, as long
+	// as the slot is still waiting on that same send.
+	class SendCallback : public cms::AsyncCallback {
+	public:
+		AmqServer *server;
+		size_t index;
+		uint64_t sequence;
+
+		virtual void onSuccess() override;
+		virtual void onException(const cms::CMSException &ex) override;
+	};
+
+	// One outstanding asynchronous send.  These are kept in a ring so
+	// they can be answered in the order they were sent, whatever order
+	// the broker confirms them in.
+	class SendSlot {
+	public:
+		FrameRef frame;
+		bool done;
+		bool success;
+		bool refused;
+
+		// Which send this is, so a late answer for an earlier one is
+		// ignored
+		uint64_t sequence;
+		SendCallback *callback;
+
+		// When it went out, on the Metrics clock
+		uint64_t sentAt;
+	};
+
 	std::string brokerUri;
 	std::string user;
 	std::string pass;
 	std::string queueName;
 	bool jsonEnvelope;
+	Options options;
 
 	cms::ConnectionFactory *factory;
-	cms::Connection *connection;
-	cms::Session *session;
+
+	// Only touched by the sender thread
+	Channel *channel;
+
+	// Kept connected by the standby thread, and taken over by the sender
+	// when its own connection fails.
+	Channel *standby;
+	std::thread *standbyThread;
+	std::mutex standbyLock;
+	std::condition_variable standbyWake;
+
+	// Open while we have a connection, or are still making the first one
+	// - sends fail straight away when it isn't, instead of waiting out
+	// their timeout.
+	std::atomic<bool> connected;
 
 	std::thread *thread;
 
-	std::list<FrameRef> sendQueue;
-	std::mutex sendQueueLock;
-	std::condition_variable sendQueueCond;
+	std::vector<SendSlot> sendSlots;
+	size_t sendSlotHead;
+	size_t sendSlotCount;
+	std::mutex sendSlotLock;
+	std::condition_variable sendSlotWake;
+	uint64_t sendSequence;
+
+	// Callbacks for sends abandoned with a dead connection.  They're never
+	// reused, in case the broker still answers them.
+	std::vector<SendCallback *> retiredCallbacks;
+
+	// Connection threads push here without locking, and only the sender
+	// thread pops.
+	RingQueue<FrameRef> sendQueue;
+	Signal sendQueueSignal;
 
-	virtual void onException(const cms::CMSException &ex);
+	std::unique_ptr<Gauge> sendQueueGauge;
 
 	volatile bool run;
-	volatile bool error;
+	std::atomic<bool> error;
+
+	bool failing() {
+		return error || channel->failed;
+	}
 
 protected:
-	bool connect();
-	void disconnect();
-	bool send(FrameRef);
+	Channel *connect();
+	void disconnect(Channel *);
+	void fillMessage(FrameRef);
+
+	bool send(FrameRef, bool &refused);
+	bool sendAsync(FrameRef);
+	bool resolve(size_t index, uint64_t sequence, bool success, bool refused);
+	void fail(std::atomic<bool> &flag);
+	void abandonSlots();
+	bool sendBatch(std::vector<FrameRef> &);
+
+	void takeFrames(std::vector<FrameRef> &);
+	void pause(long timeout);
 
 	void runLoop();
+	void standbyLoop();
 
 public:
 	AmqServer(
@@ -66,24 +157,28 @@ public:
 		char const *user,
 		char const *pass,
 		char const *queueName,
-		bool jsonEnvelope);
+		bool jsonEnvelope,
+		Options const &options);
 
 	static ServerRef Create(
         char const *uri,
         char const *user,
         char const *pass,
 		char const *queueName,
-		bool jsonEnvelope)
+		bool jsonEnvelope,
+		Options const &options)
 	{
 		return std::make_shared<AmqServer>(
-			uri, user, pass, queueName, jsonEnvelope);
+			uri, user, pass, queueName, jsonEnvelope, options);
 	}
 
 	virtual ~AmqServer();
 
 	bool queue(MessageRef);
+	FrameRef submit(MessageRef,
+		std::function<void(bool success)> done= nullptr);
 
-	void start();
+	bool start();
 	void stop();
 };
 
@@ -0,0 +1,37 @@
+
+// Jittered exponential backoff.  Each delay doubles the last one up to the
+// maximum, and is then picked at random from the upper half of that, so a
+// crowd of clients that failed together don't all come back together.
+
+class Backoff {
+public:
+	// Both in microseconds
+	Backoff(long minimum, long maximum)
+		: random(std::random_device()())
+	{
+		this->minimum= minimum;
+		this->maximum= std::max(minimum, maximum);
+
+		current= 0;
+	}
+
+	long next()
+	{
+		current= (current == 0) ? minimum : std::min(current * 2, maximum);
+
+		std::uniform_int_distribution<long> spread(current / 2, current);
+		return spread(random);
+	}
+
+	void reset()
+	{
+		current= 0;
+	}
+
+private:
+	long minimum;
+	long maximum;
+	long current;
+
+	std::minstd_rand random;
+};
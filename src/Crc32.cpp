@@ -0,0 +1,85 @@
+#include "system.h"
+
+#include "Crc32.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32_X86
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+struct CrcTable {
+	uint32_t entries[256];
+
+	CrcTable()
+	{
+		for (uint32_t i= 0; i < 256; i++) {
+			uint32_t crc= i;
+			for (int bit= 0; bit < 8; bit++) {
+				crc= (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+			}
+			entries[i]= crc;
+		}
+	}
+};
+
+static uint32_t updateScalar(uint32_t crc, void const *data, size_t dataLen)
+{
+	static CrcTable table;
+
+	unsigned char const *next= static_cast<unsigned char const *>(data);
+
+	crc= ~crc;
+	for (size_t i= 0; i < dataLen; i++) {
+		crc= table.entries[(crc ^ next[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+#ifdef CRC32_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t updateSse42(uint32_t crc, void const *data, size_t dataLen)
+{
+	unsigned char const *next= static_cast<unsigned char const *>(data);
+
+	uint64_t crc64= ~crc;
+	for (; dataLen >= 8; dataLen-= 8, next+= 8) {
+		uint64_t chunk;
+		memcpy(&chunk, next, 8);
+		crc64= _mm_crc32_u64(crc64, chunk);
+	}
+
+	uint32_t crc32= (uint32_t)crc64;
+	for (; dataLen > 0; dataLen--, next++) {
+		crc32= _mm_crc32_u8(crc32, *next);
+	}
+
+	return ~crc32;
+}
+
+#endif
+
+typedef uint32_t (*CrcFunction)(uint32_t, void const *, size_t);
+
+static CrcFunction pickImplementation()
+{
+#ifdef CRC32_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse4.2")) {
+		return updateSse42;
+	}
+#endif
+
+	return updateScalar;
+}
+
+uint32_t Crc32::update(uint32_t crc, void const *data, size_t dataLen)
+{
+	static CrcFunction function= pickImplementation();
+
+	return function(crc, data, dataLen);
+}
@@ -0,0 +1,8 @@
+// CRC-32C (Castagnoli), using the SSE4.2 instruction when the CPU has it.
+// Pass the result of one call as the crc of the next to checksum data that
+// isn't contiguous.
+
+class Crc32 {
+public:
+	static uint32_t update(uint32_t crc, void const *data, size_t dataLen);
+};
@@ -0,0 +1,259 @@
+#include "system.h"
+
+#include "Log.h"
+#include "Message.h"
+#include "Server.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+#include "DedupServer.h"
+
+#define INDEX_FILE "/dedup.idx"
+#define INDEX_MAGIC "MLLPDUP1"
+#define INDEX_HEADER_SIZE 64
+
+// Slots in the table, a power of two.  At 16 bytes each that's 16MB.
+#define INDEX_SLOTS (1 << 20)
+
+// Slots tried for each key.  If none of them are free the oldest one is
+// given up, so a busy table forgets early rather than growing.
+#define INDEX_PROBES 16
+
+struct IndexHeader {
+	char magic[8];
+	uint64_t slots;
+};
+
+DedupServer::DedupServer(char const *basePath, ServerRef upstream, int window)
+{
+	if (basePath != NULL) {
+		indexPath= basePath;
+		indexPath.append(INDEX_FILE);
+	}
+
+	this->upstream= upstream;
+	this->window= window;
+
+	assert(this->upstream);
+
+	mapping= MAP_FAILED;
+	mappingSize= INDEX_HEADER_SIZE + INDEX_SLOTS * sizeof(Slot);
+	slots= NULL;
+}
+
+DedupServer::~DedupServer()
+{
+}
+
+bool DedupServer::openIndex()
+{
+	bool success= false;
+
+	int fd= open(indexPath.c_str(), O_RDWR|O_CREAT|O_CLOEXEC,
+		S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+
+	if (fd == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to open dedup index %s: %s",
+			indexPath.c_str(), strerror(errno));
+		return false;
+	}
+
+	IndexHeader header;
+	memset(&header, 0, sizeof(header));
+
+	struct stat info;
+	bool valid= (fstat(fd, &info) == 0) &&
+		((size_t)info.st_size == mappingSize) &&
+		(pread(fd, &header, sizeof(header), 0) == sizeof(header)) &&
+		!memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) &&
+		(header.slots == INDEX_SLOTS);
+
+	if (!valid) {
+		// Missing, torn or from a different build - start it over empty
+		memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+		header.slots= INDEX_SLOTS;
+
+		if ((ftruncate(fd, 0) == -1) ||
+			(ftruncate(fd, mappingSize) == -1) ||
+			(pwrite(fd, &header, sizeof(header), 0) != sizeof(header)))
+		{
+			Log::log(LOG_ERROR,
+				"Unable to initialize dedup index %s: %s",
+				indexPath.c_str(), strerror(errno));
+
+			close(fd);
+			return false;
+		}
+	}
+
+	mapping= mmap(NULL, mappingSize,
+		PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (mapping == MAP_FAILED) {
+		Log::log(LOG_ERROR,
+			"Unable to map dedup index %s: %s",
+			indexPath.c_str(), strerror(errno));
+	} else {
+		success= true;
+	}
+
+	close(fd);
+
+	return success;
+}
+
+bool DedupServer::start()
+{
+	// Losing the file only costs the duplicates it would have caught, so
+	// fall back to memory rather than refusing to start.
+
+	if (indexPath.empty() || !openIndex()) {
+		mapping= mmap(NULL, mappingSize,
+			PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+		if (mapping == MAP_FAILED) {
+			Log::log(LOG_CRITICAL,
+				"Unable to allocate dedup index: %s", strerror(errno));
+			return false;
+		}
+	}
+
+	slots= reinterpret_cast<Slot *>(
+		static_cast<char *>(mapping) + INDEX_HEADER_SIZE);
+
+	return true;
+}
+
+void DedupServer::stop()
+{
+	std::lock_guard<std::mutex> permit(lock);
+
+	if (mapping != MAP_FAILED) {
+		if (!indexPath.empty() && (msync(mapping, mappingSize, MS_SYNC) == -1)) {
+			Log::log(LOG_ERROR,
+				"Unable to sync dedup index %s: %s",
+				indexPath.c_str(), strerror(errno));
+		}
+
+		munmap(mapping, mappingSize);
+		mapping= MAP_FAILED;
+		slots= NULL;
+	}
+}
+
+// FNV leaves the high bits better mixed than the low ones
+static size_t home(uint64_t key)
+{
+	return (size_t)(key ^ (key >> 32)) & (INDEX_SLOTS - 1);
+}
+
+bool DedupServer::seen(uint64_t key, int64_t now)
+{
+	// Called with the lock held.  Slots are never emptied once used, so an
+	// empty one ends the search.
+
+	size_t index= home(key);
+	for (int i= 0; i < INDEX_PROBES; i++) {
+		Slot const &slot= slots[(index + i) & (INDEX_SLOTS - 1)];
+
+		if (slot.key == 0) {
+			break;
+		}
+		if (slot.key == key) {
+			return (now - slot.seen) <= window;
+		}
+	}
+
+	return false;
+}
+
+void DedupServer::remember(uint64_t key, int64_t now)
+{
+	// Called with the lock held
+
+	Slot *target= NULL;
+
+	size_t index= home(key);
+	for (int i= 0; i < INDEX_PROBES; i++) {
+		Slot &slot= slots[(index + i) & (INDEX_SLOTS - 1)];
+
+		if ((slot.key == 0) || (slot.key == key)) {
+			target= &slot;
+			break;
+		}
+
+		// Nothing free, so give up the one that's been there longest
+		if ((target == NULL) || (slot.seen < target->seen)) {
+			target= &slot;
+		}
+	}
+
+	target->key= key;
+	target->seen= now;
+}
+
+bool DedupServer::queue(MessageRef message)
+{
+	return submit(message)->await(10);
+}
+
+FrameRef DedupServer::submit(MessageRef message,
+	std::function<void(bool success)> done)
+{
+	uint64_t key= message->getKey();
+	if (key == 0) {
+		return upstream->submit(message, done);
+	}
+
+	int64_t now= message->getTimestamp();
+
+	bool answered= false;
+	bool success= false;
+
+	{
+		std::lock_guard<std::mutex> permit(lock);
+
+		if (seen(key, now)) {
+			Log::log(LOG_INFO,
+				"Duplicate message from %s within %d seconds - not sent again",
+				message->getRemoteHost(), window);
+
+			answered= true;
+			success= true;
+		} else if (!pending.insert(key).second) {
+			// The first copy could still fail, so this one can't be
+			// accepted yet either.  The sender will try it again.
+			Log::log(LOG_INFO,
+				"Duplicate message from %s still being sent - not accepted",
+				message->getRemoteHost());
+
+			answered= true;
+		}
+	}
+
+	if (answered) {
+		FrameRef frame= Frame::Create(message, done);
+		frame->complete(success);
+
+		return frame;
+	}
+
+	// Only remembered once it's safely upstream.  If the send failed the
+	// resend has to go through, even if the broker may have it already.
+
+	return upstream->submit(message, [this, key, now, done](bool success) {
+		{
+			std::lock_guard<std::mutex> permit(lock);
+
+			pending.erase(key);
+			if (success) {
+				remember(key, now);
+			}
+		}
+
+		if (done) {
+			done(success);
+		}
+	});
+}
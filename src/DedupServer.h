@@ -0,0 +1,61 @@
+class Message;
+typedef std::shared_ptr<Message> MessageRef;
+
+class Server;
+typedef std::shared_ptr<Server> ServerRef;
+
+// Answers a resend of a message that already went upstream without sending
+// it again.  Senders resend whenever our acknowledgement goes missing, so
+// without this every lost ACK turns into a duplicate on the queue.
+//
+// Messages are known by a hash of their sender and control ID, kept with
+// the time they were seen in a fixed size open addressing table.  With a
+// local queue the table is a file mapped in the queue directory, so what
+// was seen before a restart is still known after it.
+
+class DedupServer : public Server {
+public:
+	DedupServer(char const *basePath, ServerRef upstream, int window);
+
+	static ServerRef Create(
+		char const *basePath, ServerRef upstream, int window)
+	{
+		return std::make_shared<DedupServer>(basePath, upstream, window);
+	}
+
+	virtual ~DedupServer();
+
+	virtual bool queue(MessageRef) override;
+	virtual FrameRef submit(MessageRef,
+		std::function<void(bool success)> done= nullptr) override;
+
+	virtual bool start() override;
+	virtual void stop() override;
+
+private:
+	struct Slot {
+		uint64_t key;
+		int64_t seen;
+	};
+
+	// Empty if the table only lives in memory
+	std::string indexPath;
+
+	ServerRef upstream;
+
+	// Seconds a message is remembered for
+	int window;
+
+	std::mutex lock;
+	void *mapping;
+	size_t mappingSize;
+	Slot *slots;
+
+	// Keys on their way upstream right now.  Only remembered for good once
+	// they've arrived, but a copy coming in meanwhile mustn't follow.
+	std::unordered_set<uint64_t> pending;
+
+	bool openIndex();
+	bool seen(uint64_t key, int64_t now);
+	void remember(uint64_t key, int64_t now);
+};
@@ -0,0 +1,165 @@
+#include "system.h"
+
+#include "Log.h"
+#include "EventLoop.h"
+
+#define WATCH_EVENTS (EPOLLIN|EPOLLRDHUP|EPOLLET|EPOLLONESHOT)
+
+EventLoop::EventLoop(int threadCount)
+{
+	this->threadCount= threadCount;
+
+	epollFd= -1;
+	stopPipe[0]= -1;
+	stopPipe[1]= -1;
+
+	stopWatch.handler= NULL;
+	stopWatch.fd= -1;
+}
+
+EventLoop::~EventLoop()
+{
+}
+
+bool EventLoop::add(Watch *watch)
+{
+	bool success= false;
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events= WATCH_EVENTS;
+	event.data.ptr= watch;
+
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, watch->fd, &event) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to add descriptor %d to epoll set: %s",
+			watch->fd, strerror(errno));
+	} else {
+		success= true;
+	}
+
+	return success;
+}
+
+bool EventLoop::rearm(Watch *watch)
+{
+	bool success= false;
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events= WATCH_EVENTS;
+	event.data.ptr= watch;
+
+	if (epoll_ctl(epollFd, EPOLL_CTL_MOD, watch->fd, &event) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to re-arm descriptor %d in epoll set: %s",
+			watch->fd, strerror(errno));
+	} else {
+		success= true;
+	}
+
+	return success;
+}
+
+void EventLoop::remove(Watch *watch)
+{
+	if (epoll_ctl(epollFd, EPOLL_CTL_DEL, watch->fd, NULL) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to remove descriptor %d from epoll set: %s",
+			watch->fd, strerror(errno));
+	}
+}
+
+void EventLoop::runLoop()
+{
+	for (bool run= true; run; ) {
+		// Only take one event at a time - a handler can block for a long
+		// while, and any other events we grabbed would be stuck behind it
+		// instead of going to an idle thread.
+
+		struct epoll_event event;
+		int waitRval= epoll_wait(epollFd, &event, 1, -1);
+
+		if (waitRval == -1) {
+			if (errno != EINTR) {
+				Log::log(LOG_ERROR,
+					"Error in epoll_wait: %s",
+					strerror(errno));
+				sleep(1);
+			}
+		} else if (waitRval > 0) {
+			Watch *watch= static_cast<Watch *>(event.data.ptr);
+			if (watch == &stopWatch) {
+				run= false;
+			} else {
+				watch->handler->handleEvent(watch->fd);
+			}
+		}
+	}
+}
+
+bool EventLoop::start()
+{
+	epollFd= epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to create epoll set: %s",
+			strerror(errno));
+
+		return false;
+	}
+
+	if (pipe2(stopPipe, O_CLOEXEC) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to create event loop stop pipe pair: %s",
+			strerror(errno));
+
+		return false;
+	}
+
+	// The stop pipe is level-triggered and never drained, so once it's
+	// written every thread in the pool sees it.
+
+	stopWatch.fd= stopPipe[0];
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events= EPOLLIN;
+	event.data.ptr= &stopWatch;
+
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, stopPipe[0], &event) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to add stop pipe to epoll set: %s",
+			strerror(errno));
+
+		return false;
+	}
+
+	for (int i= 0; i < threadCount; i++) {
+		threads.push_back(new std::thread(&EventLoop::runLoop, this));
+	}
+
+	Log::log(LOG_INFO,
+		"Started %d event loop threads", threadCount);
+
+	return true;
+}
+
+void EventLoop::stop()
+{
+	if (write(stopPipe[1], "\0", 1) == -1) {
+		Log::log(LOG_ERROR,
+			"Error writing to event loop stop pipe: %s",
+			strerror(errno));
+	}
+
+	for (std::thread *thread : threads) {
+		thread->join();
+		delete thread;
+	}
+	threads.clear();
+
+	close(stopPipe[0]);
+	close(stopPipe[1]);
+	close(epollFd);
+}
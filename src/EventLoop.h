@@ -0,0 +1,49 @@
+
+// The EventLoop is a small pool of threads sharing one epoll set.  Every
+// descriptor is registered edge-triggered and one-shot, so whichever thread
+// picks up an event owns that watch until it re-arms it.  This keeps a
+// handler that blocks (for instance waiting on the broker) from tying up
+// anything but its own thread.
+
+class EventLoop {
+public:
+	class Handler {
+	public:
+		virtual ~Handler() {}
+
+		virtual void handleEvent(int fd) = 0;
+	};
+
+	struct Watch {
+		Handler *handler;
+		int fd;
+	};
+
+	EventLoop(int threadCount);
+	virtual ~EventLoop();
+
+	static std::shared_ptr<EventLoop> Create(int threadCount)
+	{
+		return std::make_shared<EventLoop>(threadCount);
+	}
+
+	bool start();
+	void stop();
+
+	bool add(Watch *);
+	bool rearm(Watch *);
+	void remove(Watch *);
+
+private:
+	int threadCount;
+	int epollFd;
+
+	int stopPipe[2];
+	Watch stopWatch;
+
+	std::list<std::thread *> threads;
+
+	void runLoop();
+};
+
+typedef std::shared_ptr<EventLoop> EventLoopRef;
@@ -0,0 +1,31 @@
+
+// FNV-1a - not much of a hash, but cheap, and stable from run to run, which
+// is all that's needed to group messages by where they came from.
+
+class Fnv {
+public:
+	static uint32_t hash(char const *data, size_t dataLen)
+	{
+		uint32_t hash= 2166136261U;
+		for (size_t i= 0; i < dataLen; i++) {
+			hash^= (unsigned char)data[i];
+			hash*= 16777619U;
+		}
+
+		return hash;
+	}
+
+	// The 64 bit version, for keys that have to stay apart across millions
+	// of messages.  Pass the last result back in to hash several pieces as
+	// if they were one.
+	static uint64_t hash64(char const *data, size_t dataLen,
+		uint64_t hash= 14695981039346656037ULL)
+	{
+		for (size_t i= 0; i < dataLen; i++) {
+			hash^= (unsigned char)data[i];
+			hash*= 1099511628211ULL;
+		}
+
+		return hash;
+	}
+};
@@ -0,0 +1,98 @@
+#include "system.h"
+
+#include "Log.h"
+#include "Message.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+
+#define FRAME_POOL_SIZE 1024
+
+static RingQueue<Frame *> framePool(FRAME_POOL_SIZE);
+
+Frame::Frame()
+{
+	state.store(PENDING);
+	refs.store(0);
+}
+
+FrameRef Frame::Create(MessageRef message, Callback done)
+{
+	Frame *frame= NULL;
+	if (!framePool.pop(frame)) {
+		frame= new Frame();
+	}
+
+	frame->message= message;
+	frame->done= std::move(done);
+	frame->state.store(PENDING, std::memory_order_relaxed);
+	frame->refs.store(1, std::memory_order_relaxed);
+
+	return FrameRef(frame);
+}
+
+void Frame::release()
+{
+	if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		message= nullptr;
+		done= nullptr;
+
+		if (!framePool.push(this)) {
+			delete this;
+		}
+	}
+}
+
+bool Frame::await(int timeout)
+{
+	auto deadline= std::chrono::steady_clock::now() +
+		std::chrono::seconds(timeout);
+
+	int current;
+	while ((current= state.load()) == PENDING) {
+		long remaining= std::chrono::duration_cast<std::chrono::microseconds>(
+			deadline - std::chrono::steady_clock::now()).count();
+
+		if (remaining <= 0) {
+			// Only abandon it if the answer didn't just show up
+			if (abandon()) {
+				Log::log(LOG_WARNING, "Timeout waiting for call frame");
+			}
+		} else {
+			Futex::wait(&state, PENDING, remaining);
+		}
+	}
+
+	return current == SUCCEEDED;
+}
+
+bool Frame::settle(int outcome)
+{
+	int expected= PENDING;
+	if (!state.compare_exchange_strong(expected, outcome)) {
+		return false;
+	}
+
+	Futex::wake(&state, 1);
+
+	if (done) {
+		done(outcome == SUCCEEDED);
+	}
+
+	return true;
+}
+
+void Frame::complete(bool success)
+{
+	settle(success ? SUCCEEDED : FAILED);
+}
+
+void Frame::reject()
+{
+	settle(REJECTED);
+}
+
+bool Frame::abandon()
+{
+	return settle(ABANDONED);
+}
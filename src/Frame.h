@@ -0,0 +1,125 @@
+class Message;
+typedef std::shared_ptr<Message> MessageRef;
+
+class FrameRef;
+
+// A call frame for handing a message to a sender thread and waiting for the
+// answer.  Completion is a single atomic state change that the waiter
+// sleeps on with a futex, so an answer that arrives before the waiter
+// starts waiting can't be missed.  Frames are recycled through a lock-free
+// pool instead of being allocated for every message.
+//
+// Anyone who can't sleep on the answer can pass a callback instead, which
+// is run by whoever settles the frame, once, however it ends up.
+
+class Frame {
+public:
+	typedef std::function<void(bool success)> Callback;
+
+	static FrameRef Create(MessageRef message, Callback done= nullptr);
+
+	MessageRef getMessage() {
+		return message;
+	}
+
+	bool isAbandoned() {
+		return state.load() == ABANDONED;
+	}
+	bool isComplete() {
+		return state.load() != PENDING;
+	}
+	bool isSucceeded() {
+		return state.load() == SUCCEEDED;
+	}
+
+	// Failed because the broker turned down this message in particular,
+	// rather than because there was no connection to send it on.
+	bool isRejected() {
+		return state.load() == REJECTED;
+	}
+
+	// Timeout is in seconds
+	bool await(int timeout);
+	void complete(bool success);
+	void reject();
+
+	// Gives up on the answer.  False if it had already come in.
+	bool abandon();
+
+private:
+	Frame();
+
+	enum {
+		PENDING,
+		SUCCEEDED,
+		FAILED,
+		REJECTED,
+		ABANDONED
+	};
+
+	MessageRef message;
+	Callback done;
+
+	std::atomic<int> state;
+	std::atomic<int> refs;
+
+	void retain() {
+		refs.fetch_add(1, std::memory_order_relaxed);
+	}
+	void release();
+
+	bool settle(int outcome);
+
+	friend class FrameRef;
+};
+
+// Reference counted handle to a pooled Frame - the frame goes back to the
+// pool when the last handle lets go of it.
+
+class FrameRef {
+public:
+	FrameRef() {
+		frame= NULL;
+	}
+	FrameRef(std::nullptr_t) {
+		frame= NULL;
+	}
+	FrameRef(FrameRef const &other) {
+		frame= other.frame;
+		if (frame != NULL) {
+			frame->retain();
+		}
+	}
+	FrameRef(FrameRef &&other) {
+		frame= other.frame;
+		other.frame= NULL;
+	}
+
+	~FrameRef() {
+		if (frame != NULL) {
+			frame->release();
+		}
+	}
+
+	FrameRef &operator=(FrameRef other) {
+		std::swap(frame, other.frame);
+		return *this;
+	}
+
+	Frame *operator->() const {
+		return frame;
+	}
+	explicit operator bool() const {
+		return frame != NULL;
+	}
+
+private:
+	// Takes over the caller's reference
+	explicit FrameRef(Frame *frame) {
+		this->frame= frame;
+	}
+
+	Frame *frame;
+
+	friend class Frame;
+};
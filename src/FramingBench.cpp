@@ -0,0 +1,245 @@
+#include "system.h"
+
+#include "Log.h"
+#include "MessageScan.h"
+#include "MllpFramer.h"
+
+// Times getting MLLP frames off a socket with the connection's own framer,
+// reading the way the listener used to and the way it does now.  The old
+// way read 16 bytes at a time; the new way reads into a buffer that grows
+// with the traffic.  A writer thread pushes framed messages through a
+// socket pair, so the reads are real system calls.
+
+#define BYTE_READ_SIZE 16
+
+#define READ_BUFFER_MIN 4096
+#define READ_BUFFER_MAX (256 * 1024)
+
+static uint64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// An ADT^A01 of about 1KB, the usual run of traffic
+static std::string makeAdt()
+{
+	std::string message=
+		"MSH|^~\\&|REGADT|MCM|IFENG||20260101120000||ADT^A01|CTL0001|P|2.4\r"
+		"EVN|A01|20260101120000\r"
+		"PID|||191919^^^GENHOS^MR~371-66-9256^^^USSSA^SS||"
+		"MASSIE^JAMES^A||19560129|M|||171 ZOBERLEIN^^ISHPEMING^MI^49849"
+		"^\"\"^||(900)485-5344|(900)485-5344||S|C|10199925^^^GENHOS^AN|"
+		"371-66-9256||\r"
+		"NK1|1|MASSIE^ELLEN|SPOUSE|171 ZOBERLEIN^^ISHPEMING^MI^49849^\"\"^|"
+		"(900)485-5344|(900)545-1234~(900)545-1200|EC1^FIRST EMERGENCY "
+		"CONTACT\r"
+		"PV1||O|O/R||||0148^ADDISON^JAMES|0148^ADDISON^JAMES|0148^ADDISON"
+		"^JAMES|AMB|||||||0148^ADDISON^JAMES|S|1400|A|||||||||||||||||||"
+		"GENHOS|||||199501102300\r"
+		"OBX||ST|1010.1^BODY WEIGHT||62|kg|||||F\r"
+		"OBX||ST|1010.1^HEIGHT||190|cm|||||F\r"
+		"DG1|1|19||BIOPSY||00|\r"
+		"GT1|1||MASSIE^JAMES^\"\"^\"\"^\"\"^\"\"^||171 ZOBERLEIN^^ISHPEMING"
+		"^MI^49849^\"\"^|(900)485-5344|(900)485-5344||||SE^SELF|371-66-925||"
+		"||MOOSES AUTO CLINIC|171 ZOBERLEIN^^ISHPEMING^MI^49849^\"\"|"
+		"(900)485-5344|\r"
+		"IN1|0|0|BC1|BLUE CROSS|171 ZOBERLEIN^^ISHPEMING^M149849^\"\"^||"
+		"(900)485-5344|90||||||50 OK|\r";
+
+	while (message.length() < 1024) {
+		message.append("NTE|1||ROUTINE ADMISSION NOTE\r");
+	}
+
+	return message;
+}
+
+// An ORU^R01 of about 200KB carrying a PDF report as base64
+static std::string makeOru()
+{
+	static char const base64[]=
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	std::string message=
+		"MSH|^~\\&|LAB|MCM|IFENG||20260101120000||ORU^R01|CTL0002|P|2.4\r"
+		"PID|||555444222111^^^MPI&GenHosp&L^MR||MAIDENNAME^EVE||19620320|F\r"
+		"OBR|1|845439^GHH OE|1045813^GHH LAB|15545^GLUCOSE|||200202150730\r"
+		"OBX|1|ED|PDF^Report||^application^pdf^Base64^";
+
+	for (size_t i= 0; i < 200 * 1024; i++) {
+		message.push_back(base64[(i * 7 + i / 64) % 64]);
+	}
+	message.append("||||||F\r");
+
+	return message;
+}
+
+// Pushes total bytes of framed copies of message through a socket pair and
+// returns the messages framed per second, or 0 if the framing went wrong
+static double run(std::string const &message, size_t total, bool adaptive)
+{
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to create socket pair: %s", strerror(errno));
+		return 0;
+	}
+
+	std::string frame;
+	frame.push_back(0x0B);
+	frame.append(message);
+	frame.push_back(0x1C);
+	frame.push_back(0x0D);
+
+	long count= std::max(total / frame.length(), (size_t)1);
+
+	std::thread writer([&]() {
+		for (long i= 0; i < count; i++) {
+			char const *data= frame.data();
+			size_t left= frame.length();
+
+			while (left > 0) {
+				ssize_t written= write(pair[1], data, left);
+				if (written < 0) {
+					if (errno != EINTR) {
+						break;
+					}
+				} else {
+					data+= written;
+					left-= written;
+				}
+			}
+		}
+
+		shutdown(pair[1], SHUT_WR);
+	});
+
+	MllpFramer framer;
+	long messages= 0;
+	bool valid= true;
+
+	std::vector<char> buffer(adaptive ? READ_BUFFER_MIN : BYTE_READ_SIZE);
+
+	uint64_t started= now();
+
+	for (;;) {
+		size_t bufferSize= buffer.size();
+
+		ssize_t bufferLen= read(pair[0], buffer.data(), bufferSize);
+		if (bufferLen < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			valid= false;
+			break;
+		}
+		if (bufferLen == 0) {
+			break;
+		}
+
+		// Handed off the way the connection does, though nothing is done
+		// with it after that
+		char const *data= buffer.data();
+		size_t dataLen= bufferLen;
+		while (valid && (dataLen > 0)) {
+			size_t used;
+			MllpFramer::Result result= framer.frame(data, dataLen, used);
+			data+= used;
+			dataLen-= used;
+
+			if (result == MllpFramer::Result::INVALID) {
+				valid= false;
+			} else if (result == MllpFramer::Result::MESSAGE) {
+				std::string taken(std::move(framer.getMessage()));
+				framer.next();
+				messages++;
+			}
+		}
+
+		if (!valid) {
+			break;
+		}
+
+		if (!adaptive) {
+			continue;
+		}
+
+		// Same sizing as TcpConnection
+		if ((size_t)bufferLen == bufferSize) {
+			if (bufferSize < READ_BUFFER_MAX) {
+				buffer.resize(bufferSize * 2);
+			}
+		} else if ((size_t)bufferLen < (bufferSize / 8)) {
+			if (bufferSize > READ_BUFFER_MIN) {
+				buffer.resize(bufferSize / 2);
+				buffer.shrink_to_fit();
+			}
+		}
+	}
+
+	double elapsed= std::max(now() - started, (uint64_t)1) / 1e6;
+
+	// Lets the writer out if the reader gave up early
+	close(pair[0]);
+	writer.join();
+	close(pair[1]);
+
+	if (!valid || (messages != count)) {
+		Log::log(LOG_ERROR,
+			"Framed %ld of %ld messages", messages, count);
+		return 0;
+	}
+
+	return count / elapsed;
+}
+
+static void compare(char const *name, std::string const &message, size_t total)
+{
+	double before= run(message, total, false);
+	double after= run(message, total, true);
+
+	double size= (message.length() + 3) / (1024.0 * 1024.0);
+
+	printf("%s (%zu bytes):\n", name, message.length());
+	printf("  16 byte reads:   %10.1f msg/s, %8.2f MB/s\n",
+		before, before * size);
+	printf("  adaptive buffer: %10.1f msg/s, %8.2f MB/s\n",
+		after, after * size);
+}
+
+int main(int argc, char* argv[])
+{
+	Log::start();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// Megabytes framed in each run
+	long megabytes= 32;
+
+	int c;
+	while ((c= getopt(argc, argv, "m:")) != -1) {
+		switch (c) {
+		case 'm':
+			megabytes= atol(optarg);
+			if (megabytes < 1) {
+				Log::log(LOG_ERROR,
+					"Size is invalid");
+				exit(1);
+			}
+			break;
+
+		default:
+			fprintf(stderr, "Unknown argument %c\n", optopt);
+			exit(1);
+		}
+	}
+
+	printf("Message validation: %s\n", MessageScan::getImplementation());
+
+	size_t total= (size_t)megabytes * 1024 * 1024;
+
+	compare("ADT^A01", makeAdt(), total);
+	compare("ORU^R01", makeOru(), total);
+
+	return 0;
+}
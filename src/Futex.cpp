@@ -0,0 +1,26 @@
+#include "system.h"
+
+#include "Futex.h"
+
+void Futex::wait(std::atomic<int> *word, int expected, long timeout)
+{
+	struct timespec ts;
+	struct timespec *tsp= NULL;
+
+	if (timeout >= 0) {
+		ts.tv_sec= timeout / 1000000;
+		ts.tv_nsec= (timeout % 1000000) * 1000;
+		tsp= &ts;
+	}
+
+	// EAGAIN (value already changed), EINTR and ETIMEDOUT all just mean
+	// the caller should look again.
+	syscall(SYS_futex, reinterpret_cast<int *>(word),
+		FUTEX_WAIT_PRIVATE, expected, tsp, NULL, 0);
+}
+
+void Futex::wake(std::atomic<int> *word, int count)
+{
+	syscall(SYS_futex, reinterpret_cast<int *>(word),
+		FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
@@ -0,0 +1,55 @@
+// Thin wrappers over the Linux futex call, for sleeping on an atomic word
+// without a mutex and condition variable behind it.
+
+class Futex {
+public:
+	// Sleeps as long as *word still holds expected, for at most timeout
+	// microseconds, or forever if timeout is negative.  Can return early.
+	static void wait(std::atomic<int> *word, int expected, long timeout);
+
+	static void wake(std::atomic<int> *word, int count);
+};
+
+// An event count: lets a consumer sleep until a lock-free structure might
+// have something for it, without a window where a notify can be lost.
+//
+//   int key= signal.prepare();
+//   if (nothing to do) signal.wait(key, timeout);
+//   signal.finish();
+
+class Signal {
+public:
+	Signal()
+	{
+		sequence.store(0);
+		waiters.store(0);
+	}
+
+	int prepare()
+	{
+		waiters.fetch_add(1);
+		return sequence.load();
+	}
+
+	void wait(int key, long timeout)
+	{
+		Futex::wait(&sequence, key, timeout);
+	}
+
+	void finish()
+	{
+		waiters.fetch_sub(1);
+	}
+
+	void notify()
+	{
+		sequence.fetch_add(1);
+		if (waiters.load() > 0) {
+			Futex::wake(&sequence, INT_MAX);
+		}
+	}
+
+private:
+	std::atomic<int> sequence;
+	std::atomic<int> waiters;
+};
@@ -0,0 +1,91 @@
+#include "system.h"
+
+#include "EventLoop.h"
+#include "Connection.h"
+#include "TcpConnection.h"
+#include "HttpConnection.h"
+
+#include "Metrics.h"
+#include "Log.h"
+
+// Longest request head we'll hold on to before giving up on the client
+#define REQUEST_LIMIT 8192
+
+HttpConnection::HttpConnection(
+	ListenerRef listener,
+	EventLoopRef loop,
+	int sock)
+	: TcpConnection(listener, loop, sock)
+{
+}
+
+HttpConnection::~HttpConnection()
+{
+}
+
+bool HttpConnection::handleData(char const *data, int dataLen)
+{
+	bool valid= true;
+
+	request.append(data, dataLen);
+
+	size_t end;
+	while (valid && ((end= request.find("\r\n\r\n")) != std::string::npos)) {
+		std::string requestLine= request.substr(0, request.find("\r\n"));
+		request.erase(0, end + 4);
+
+		valid= respond(requestLine);
+	}
+
+	if (valid && (request.length() > REQUEST_LIMIT)) {
+		Log::log(LOG_WARNING, "HTTP request head is too long");
+		valid= false;
+	}
+
+	return valid;
+}
+
+void HttpConnection::handleEof()
+{
+}
+
+bool HttpConnection::respond(std::string const &requestLine)
+{
+	// Only the method and path matter - "GET /metrics HTTP/1.1"
+
+	size_t pathStart= requestLine.find(' ');
+	size_t pathEnd= (pathStart == std::string::npos) ?
+		std::string::npos : requestLine.find(' ', pathStart + 1);
+
+	if (pathEnd == std::string::npos) {
+		sendResponse("400 Bad Request", "text/plain", "Bad request\n");
+		return false;
+	}
+
+	std::string method= requestLine.substr(0, pathStart);
+	std::string path= requestLine.substr(pathStart + 1, pathEnd - pathStart - 1);
+
+	if (method != "GET") {
+		return sendResponse("405 Method Not Allowed", "text/plain",
+			"Only GET is supported\n");
+	} else if (path != "/metrics") {
+		return sendResponse("404 Not Found", "text/plain", "Not found\n");
+	} else {
+		return sendResponse("200 OK", "text/plain; version=0.0.4",
+			Metrics::render());
+	}
+}
+
+bool HttpConnection::sendResponse(char const *status, char const *contentType,
+	std::string const &body)
+{
+	char head[256];
+	int headLen= snprintf(head, sizeof(head),
+		"HTTP/1.1 %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %d\r\n"
+		"\r\n",
+		status, contentType, (int)body.length());
+
+	return write(head, headLen) && write(body.data(), body.length());
+}
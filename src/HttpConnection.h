@@ -0,0 +1,32 @@
+class Listener;
+typedef std::shared_ptr<Listener> ListenerRef;
+
+class EventLoop;
+typedef std::shared_ptr<EventLoop> EventLoopRef;
+
+// Just enough HTTP to answer a metrics scrape.  Requests are read up to
+// the blank line that ends the headers - a scrape never sends a body - and
+// the connection is kept open for the next one until the client closes it.
+
+class HttpConnection
+	: public TcpConnection
+{
+public:
+	HttpConnection(
+		ListenerRef listener,
+		EventLoopRef loop,
+		int sock);
+
+	virtual ~HttpConnection();
+
+protected:
+	virtual bool handleData(char const *data, int dataLen) override;
+	virtual void handleEof() override;
+
+private:
+	std::string request;
+
+	bool respond(std::string const &requestLine);
+	bool sendResponse(char const *status, char const *contentType,
+		std::string const &body);
+};
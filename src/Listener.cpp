@@ -110,7 +110,11 @@ void Listener::listenLoop()
 								connect(clientSock, remoteHost);
 
 							// Push first for no race
-							connectionList.push_back(connection);
+							{
+								std::unique_lock<std::mutex> permit(
+									connectionListLock);
+								connectionList.push_back(connection);
+							}
 							connection->start();
 						}
 					}
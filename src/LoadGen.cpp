@@ -0,0 +1,625 @@
+#include "system.h"
+
+#include "Log.h"
+
+// Pushes load through a running mllp-activemq.  Each connection gets its
+// own thread and keeps up to the pipeline depth of messages outstanding,
+// checking every ACK that comes back against the oldest one it sent -
+// MLLP answers in order, so MSA-2 has to match that one's control ID.
+// Latency is from the end of writing a message to the end of its ACK.
+
+#define READ_BUFFER 65536
+
+// Seconds to wait on an ACK before giving up on the connection
+#define ACK_TIMEOUT 30
+
+struct LoadOptions {
+	LoadOptions()
+	{
+		host= "127.0.0.1";
+		port= "2575";
+		depth= 1;
+		count= 0;
+		minSize= 1024;
+		maxSize= 1024;
+	}
+
+	char const *host;
+	char const *port;
+
+	// Messages each connection keeps outstanding
+	int depth;
+
+	// Messages each connection sends - 0 runs until time is up
+	long count;
+
+	// Synthetic messages are padded out to a size picked evenly from
+	// this range
+	size_t minSize;
+	size_t maxSize;
+
+	// Messages to replay instead, with segments ending in CR
+	std::vector<std::string> replay;
+};
+
+static volatile bool rundown;
+static std::atomic<bool> stopping(false);
+
+static void doExit(int junk)
+{
+	rundown= true;
+}
+
+static uint64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class LoadWorker {
+public:
+	LoadWorker(int id, LoadOptions const &options);
+
+	void run();
+
+	bool isDone() {
+		return done;
+	}
+
+	std::vector<uint64_t> latencies;
+	long sent;
+	long accepted;
+	long errors;
+	long rejected;
+	long invalid;
+	long missing;
+	uint64_t bytesSent;
+	uint64_t finishedAt;
+
+private:
+	struct Pending {
+		std::string controlId;
+		uint64_t sentAt;
+	};
+
+	int id;
+	LoadOptions const &options;
+
+	int sock;
+	std::deque<Pending> outstanding;
+	std::atomic<bool> done;
+
+	std::mt19937 random;
+	std::string message;
+	std::string input;
+
+	bool connect();
+	void build(std::string const &controlId);
+	bool sendMessage();
+	bool readAck(std::string &ack);
+	void check(std::string const &ack);
+};
+
+LoadWorker::LoadWorker(int id, LoadOptions const &options)
+	: options(options), random(id)
+{
+	this->id= id;
+
+	sent= 0;
+	accepted= 0;
+	errors= 0;
+	rejected= 0;
+	invalid= 0;
+	missing= 0;
+	bytesSent= 0;
+	finishedAt= 0;
+
+	sock= -1;
+	done= false;
+}
+
+bool LoadWorker::connect()
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family= AF_UNSPEC;
+	hints.ai_socktype= SOCK_STREAM;
+
+	struct addrinfo *addresses= NULL;
+	int rval= getaddrinfo(options.host, options.port, &hints, &addresses);
+	if (rval != 0) {
+		Log::log(LOG_ERROR,
+			"Unable to resolve %s: %s", options.host, gai_strerror(rval));
+		return false;
+	}
+
+	for (struct addrinfo *address= addresses;
+		(address != NULL) && (sock == -1);
+		address= address->ai_next)
+	{
+		sock= socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+			address->ai_protocol);
+
+		if ((sock != -1) &&
+			(::connect(sock, address->ai_addr, address->ai_addrlen) == -1))
+		{
+			close(sock);
+			sock= -1;
+		}
+	}
+
+	freeaddrinfo(addresses);
+
+	if (sock == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to connect to %s port %s: %s",
+			options.host, options.port, strerror(errno));
+		return false;
+	}
+
+	// Pipelined messages would otherwise sit waiting on the ACK for the
+	// last one
+	int on= 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	struct timeval timeout;
+	timeout.tv_sec= ACK_TIMEOUT;
+	timeout.tv_usec= 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	return true;
+}
+
+void LoadWorker::build(std::string const &controlId)
+{
+	message.clear();
+	message.append(1, 0x0B);
+
+	if (!options.replay.empty()) {
+		// Same message with our own control ID in MSH-10, so resends of
+		// it aren't taken for duplicates and the ACK can be matched up
+		std::string const &source= options.replay[sent % options.replay.size()];
+
+		size_t start= 0;
+		for (int field= 0; (field < 9) && (start != std::string::npos); field++) {
+			start= source.find('|', start);
+			if (start != std::string::npos) {
+				start++;
+			}
+		}
+
+		if (start == std::string::npos) {
+			// No MSH-10 to put it in, so it goes as it is, and its ACK
+			// won't match up
+			message.append(source);
+		} else {
+			size_t end= source.find_first_of("|\r", start);
+
+			message.append(source, 0, start);
+			message.append(controlId);
+			if (end != std::string::npos) {
+				message.append(source, end, std::string::npos);
+			}
+		}
+	} else {
+		std::uniform_int_distribution<size_t> sizes(
+			options.minSize, options.maxSize);
+		size_t size= sizes(random);
+
+		message.append("MSH|^~\\&|LOADGEN|LOADGEN|MLLP|ACTIVEMQ|"
+			"20240101000000||ADT^A01|");
+		message.append(controlId);
+		message.append("|P|2.4\rPID|1||");
+		message.append(std::to_string(sent));
+		message.append("||LOAD^TEST\rOBX|1|TX|||");
+
+		// The last segment fills out the rest
+		size_t length= message.length() - 1;
+		if (length + 1 < size) {
+			message.append(size - length - 1, 'X');
+		}
+		message.append("\r");
+	}
+
+	message.append(1, 0x1C);
+	message.append("\r");
+}
+
+bool LoadWorker::sendMessage()
+{
+	char controlId[32];
+	snprintf(controlId, sizeof(controlId), "LG%d-%ld", id, sent);
+
+	build(controlId);
+
+	char const *data= message.data();
+	size_t remaining= message.length();
+
+	while (remaining > 0) {
+		ssize_t nwrote= write(sock, data, remaining);
+		if (nwrote == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			Log::log(LOG_ERROR,
+				"Error writing to connection %d: %s", id, strerror(errno));
+			return false;
+		}
+
+		data+= nwrote;
+		remaining-= nwrote;
+	}
+
+	Pending pending;
+	pending.controlId= controlId;
+	pending.sentAt= now();
+	outstanding.push_back(pending);
+
+	sent++;
+	bytesSent+= message.length();
+
+	return true;
+}
+
+bool LoadWorker::readAck(std::string &ack)
+{
+	// Reads until there's a whole frame in the input, and hands back
+	// what's between the start and end blocks
+
+	for (;;) {
+		size_t start= input.find((char)0x0B);
+		if (start != std::string::npos) {
+			size_t end= input.find("\x1c\r", start);
+			if (end != std::string::npos) {
+				ack.assign(input, start + 1, end - start - 1);
+				input.erase(0, end + 2);
+				return true;
+			}
+		}
+
+		char buffer[READ_BUFFER];
+		ssize_t nread= read(sock, buffer, sizeof(buffer));
+
+		if (nread == 0) {
+			Log::log(LOG_ERROR,
+				"Connection %d closed with %d messages unanswered",
+				id, (int)outstanding.size());
+			return false;
+		} else if (nread == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			Log::log(LOG_ERROR,
+				"Error reading from connection %d: %s", id, strerror(errno));
+			return false;
+		}
+
+		input.append(buffer, nread);
+	}
+}
+
+void LoadWorker::check(std::string const &ack)
+{
+	Pending pending= outstanding.front();
+	outstanding.pop_front();
+
+	latencies.push_back(now() - pending.sentAt);
+
+	std::string code;
+	std::string controlId;
+
+	size_t msa= ack.find("\rMSA|");
+	if (msa != std::string::npos) {
+		size_t start= msa + 5;
+		size_t bar= ack.find('|', start);
+
+		if (bar != std::string::npos) {
+			code.assign(ack, start, bar - start);
+
+			size_t end= ack.find_first_of("|\r", bar + 1);
+			controlId.assign(ack, bar + 1,
+				(end == std::string::npos) ? std::string::npos : end - bar - 1);
+		}
+	}
+
+	if (controlId != pending.controlId) {
+		Log::log(LOG_WARNING,
+			"ACK on connection %d is for %s, expected %s",
+			id, controlId.c_str(), pending.controlId.c_str());
+		invalid++;
+	} else if (code == "AA") {
+		accepted++;
+	} else if (code == "AE") {
+		errors++;
+	} else if (code == "AR") {
+		rejected++;
+	} else {
+		Log::log(LOG_WARNING,
+			"ACK on connection %d has unknown code %s", id, code.c_str());
+		invalid++;
+	}
+}
+
+void LoadWorker::run()
+{
+	if (connect()) {
+		std::string ack;
+
+		for (;;) {
+			bool open= true;
+			while (open && !stopping &&
+				(outstanding.size() < (size_t)options.depth) &&
+				((options.count == 0) || (sent < options.count)))
+			{
+				open= sendMessage();
+			}
+
+			if (!open || outstanding.empty() || !readAck(ack)) {
+				break;
+			}
+
+			check(ack);
+		}
+
+		close(sock);
+	}
+
+	missing= outstanding.size();
+	finishedAt= now();
+	done= true;
+}
+
+static bool parseSize(char const *arg, LoadOptions &options)
+{
+	// Either one size, or a range as min-max
+
+	char *end;
+	long minSize= strtol(arg, &end, 10);
+	long maxSize= minSize;
+
+	if (*end == '-') {
+		maxSize= strtol(end + 1, &end, 10);
+	}
+
+	if ((*end != '\0') || (minSize < 64) || (maxSize < minSize)) {
+		return false;
+	}
+
+	options.minSize= minSize;
+	options.maxSize= maxSize;
+
+	return true;
+}
+
+static bool loadReplay(char const *path, LoadOptions &options)
+{
+	// One segment to a line, with a blank line between messages
+
+	std::ifstream in(path);
+	if (!in) {
+		Log::log(LOG_ERROR,
+			"Unable to open replay file %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	std::string line;
+	std::string message;
+
+	for (;;) {
+		bool more= (bool)std::getline(in, line);
+
+		if (!line.empty() && (line.back() == '\r')) {
+			line.pop_back();
+		}
+
+		if (more && !line.empty()) {
+			message.append(line);
+			message.append("\r");
+			continue;
+		}
+
+		if (!message.empty()) {
+			if ((message.compare(0, 4, "MSH|") != 0) ||
+				(std::count(message.begin(),
+					message.begin() + message.find('\r'), '|') < 9))
+			{
+				Log::log(LOG_ERROR,
+					"Replay message %d in %s has no MSH-10",
+					(int)options.replay.size() + 1, path);
+				return false;
+			}
+
+			options.replay.push_back(message);
+			message.clear();
+		}
+
+		if (!more) {
+			break;
+		}
+	}
+
+	if (options.replay.empty()) {
+		Log::log(LOG_ERROR, "No messages in replay file %s", path);
+		return false;
+	}
+
+	return true;
+}
+
+static double percentile(std::vector<uint64_t> const &sorted, double share)
+{
+	size_t index= (size_t)ceil(share * sorted.size());
+	if (index > 0) {
+		index--;
+	}
+
+	return sorted[std::min(index, sorted.size() - 1)] / 1000.0;
+}
+
+int main(int argc, char* argv[])
+{
+	Log::start();
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, doExit);
+	signal(SIGINT, doExit);
+
+	LoadOptions options;
+	int connections= 1;
+	int duration= 0;
+
+	int c;
+	while ((c= getopt(argc, argv, "h:p:c:D:n:t:s:f:")) != -1) {
+		switch (c) {
+		case 'h':
+			options.host= optarg;
+			break;
+
+		case 'p':
+			options.port= optarg;
+			if ((atoi(optarg) < 1) || (atoi(optarg) > 65535)) {
+				Log::log(LOG_ERROR,
+					"MLLP port is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'c':
+			connections= atoi(optarg);
+			if (connections < 1) {
+				Log::log(LOG_ERROR,
+					"Connection count is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'D':
+			options.depth= atoi(optarg);
+			if (options.depth < 1) {
+				Log::log(LOG_ERROR,
+					"Pipeline depth is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'n':
+			options.count= atol(optarg);
+			if (options.count < 1) {
+				Log::log(LOG_ERROR,
+					"Message count is invalid");
+				exit(1);
+			}
+			break;
+
+		case 't':
+			duration= atoi(optarg);
+			if (duration < 1) {
+				Log::log(LOG_ERROR,
+					"Duration is invalid");
+				exit(1);
+			}
+			break;
+
+		case 's':
+			if (!parseSize(optarg, options)) {
+				Log::log(LOG_ERROR,
+					"Message size is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'f':
+			if (!loadReplay(optarg, options)) {
+				exit(1);
+			}
+			break;
+
+		default:
+			fprintf(stderr, "Unknown argument %c\n", optopt);
+			exit(1);
+		}
+	}
+
+	// With no limit at all, run for a while
+	if ((options.count == 0) && (duration == 0)) {
+		duration= 10;
+	}
+
+	std::vector<std::unique_ptr<LoadWorker>> workers;
+	std::vector<std::thread> threads;
+
+	uint64_t started= now();
+	uint64_t deadline= started + (uint64_t)duration * 1000000;
+
+	for (int i= 0; i < connections; i++) {
+		workers.emplace_back(new LoadWorker(i, options));
+		threads.emplace_back(&LoadWorker::run, workers.back().get());
+	}
+
+	// Stop sending at the deadline or on a signal, then wait out the ACKs
+	// still coming
+	for (;;) {
+		bool running= false;
+		for (auto &worker : workers) {
+			if (!worker->isDone()) {
+				running= true;
+			}
+		}
+
+		if (!running || rundown || ((duration > 0) && (now() >= deadline))) {
+			break;
+		}
+
+		usleep(100000);
+	}
+
+	stopping= true;
+
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	long sent= 0, accepted= 0, errors= 0, rejected= 0, invalid= 0, missing= 0;
+	uint64_t bytesSent= 0;
+	uint64_t finished= started;
+	std::vector<uint64_t> latencies;
+
+	for (auto &worker : workers) {
+		sent+= worker->sent;
+		accepted+= worker->accepted;
+		errors+= worker->errors;
+		rejected+= worker->rejected;
+		invalid+= worker->invalid;
+		missing+= worker->missing;
+		bytesSent+= worker->bytesSent;
+		finished= std::max(finished, worker->finishedAt);
+
+		latencies.insert(latencies.end(),
+			worker->latencies.begin(), worker->latencies.end());
+	}
+
+	// Up to the last ACK, not to when we noticed
+	double elapsed= std::max(finished - started, (uint64_t)1) / 1e6;
+
+	printf("Sent %ld messages on %d connections in %.2f s: "
+		"%.1f msg/s, %.2f MB/s\n",
+		sent, connections, elapsed,
+		sent / elapsed, bytesSent / elapsed / (1024 * 1024));
+
+	printf("ACKs: %ld AA, %ld AE, %ld AR, %ld invalid, %ld missing\n",
+		accepted, errors, rejected, invalid, missing);
+
+	if (!latencies.empty()) {
+		std::sort(latencies.begin(), latencies.end());
+
+		printf("ACK latency ms: p50 %.3f, p99 %.3f, p999 %.3f, max %.3f\n",
+			percentile(latencies, 0.5), percentile(latencies, 0.99),
+			percentile(latencies, 0.999), latencies.back() / 1000.0);
+	}
+
+	bool clean= (sent > 0) && (accepted == sent);
+
+	return clean ? 0 : 1;
+}
@@ -3,18 +3,30 @@
 #include "Log.h"
 #include "Message.h"
 #include "Server.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+#include "Backoff.h"
+#include "SegmentLog.h"
+#include "Metrics.h"
 #include "LocalServer.h"
 
 #define QUEUE_LIMIT 8192
 
-// The LocalServer is a memory queue with file backing for permanence, not
-// a full implementation of an on-disk queue.  If this gets too large we
-// will eventually run out of memory.
+// The LocalServer acknowledges a message once it's synced to the segment
+// log, and a writer thread pushes it upstream afterwards.  Bodies are kept
+// in memory up to the memory budget - past that an entry only remembers
+// where its record is, and the writer reads the body back from the log
+// when it gets to it.
 
-Entry::Entry(char const *fileId, MessageRef message)
+Entry::Entry(SegmentLog::Location const &location, MessageRef message)
 {
-	this->fileId= fileId;
+	this->location= location;
 	this->message= message;
+
+	rejections= 0;
+	triedAt= 0;
+	backlog= false;
 }
 
 Entry::~Entry()
@@ -22,26 +34,37 @@ Entry::~Entry()
 }
 
 LocalServer::LocalServer(
-	char const *basePath, ServerRef upstream)
+	char const *basePath, ServerRef upstream, Options const &options)
 {
 	this->basePath= basePath;
 	this->upstream= upstream;
+	this->memoryBudget= options.memoryBudget;
+	this->forwardWindow= options.forwardWindow;
+	this->maxBackoff= options.maxBackoff;
+	this->backlogShare= options.backlogShare;
+	this->strictOrdering= options.strictOrdering;
+	this->quarantineAttempts= options.quarantineAttempts;
+
+	backlogCredit= 0;
 
 	assert(this->upstream);
 
-	// Files are names as YYYYMMDD_HHMMSS_NNNN, where the last 4 are
-	// just a counter to keep the name unique.
+	residentBytes= 0;
+
+	quarantinePath= basePath;
+	quarantinePath.append("/quarantine");
+	quarantined= 0;
+	deliveries= 0;
 
-	nameLastTime= (time_t)0;
-	nameCounter= 1;
+	log= SegmentLog::Create(basePath, options.segmentSize,
+		options.commitDelay, options.diskQuota, options.highWater);
 }
 
 LocalServer::~LocalServer()
 {
 }
 
-// FIXME to test cycling
-#define READ_BUFFER 15
+#define READ_BUFFER 65536
 
 bool LocalServer::readFile(char const *path, std::string &data)
 {
@@ -53,21 +76,28 @@ bool LocalServer::readFile(char const *path, std::string &data)
 			"Unable to open queue file %s: %s",
 			path, strerror(errno));
 	} else {
-		char buffer[READ_BUFFER + 1];
+		struct stat info;
+		if (fstat(fd, &info) == 0) {
+			data.reserve(info.st_size);
+		}
+
+		char buffer[READ_BUFFER];
 
 		bool error= false;
 		for (bool run= true; run; ) {
 			int bytesRead= read(fd, buffer, READ_BUFFER);
 			if (bytesRead == -1) {
-				Log::log(LOG_ERROR,
-					"Error reading from file %s: %s",
-					path, strerror(errno));
-				error= true;
+				if (errno != EINTR) {
+					Log::log(LOG_ERROR,
+						"Error reading from file %s: %s",
+						path, strerror(errno));
+					error= true;
+					run= false;
+				}
 			} else if (bytesRead == 0) {
 				run= false;
 			} else {
-				buffer[bytesRead]= '\0';
-				data.append(buffer);
+				data.append(buffer, bytesRead);
 			}
 		}
 
@@ -79,23 +109,31 @@ bool LocalServer::readFile(char const *path, std::string &data)
 }
 
 
-bool LocalServer::writeFile(char const *path, char const *data, size_t dataLen)
+bool LocalServer::writeFile(char const *path, char const *data, size_t dataLen,
+	bool &taken)
 {
 	bool success= false;
 
+	// Never writes over a file that's already there - taken says that's
+	// why it failed.
+
 	int fd= open(path,
-		O_WRONLY|O_CREAT|O_CLOEXEC|O_EXCL,
+		O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,
 		S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
 
+	taken= ((fd == -1) && (errno == EEXIST));
+
 	if (fd == -1) {
-		Log::log(LOG_ERROR,
-			"Unable to open queue file %s: %s",
-			path, strerror(errno));
+		if (!taken) {
+			Log::log(LOG_ERROR,
+				"Unable to open file %s: %s",
+				path, strerror(errno));
+		}
 	} else {
 		int written= write(fd, data, dataLen);
 		if (written == -1) {
 			Log::log(LOG_ERROR,
-				"Unable to write queue files %s: %s",
+				"Unable to write files %s: %s",
 				path, strerror(errno));
 		} else if ((size_t)written != dataLen) {
 			Log::log(LOG_ERROR,
@@ -111,7 +149,7 @@ bool LocalServer::writeFile(char const *path, char const *data, size_t dataLen)
 
 		if (close(fd) == -1) {
 			Log::log(LOG_ERROR,
-				"Error closing out queue file %s: %s",
+				"Error closing out file %s: %s",
 				path, strerror(errno));
 
 			success= false;
@@ -134,84 +172,38 @@ bool LocalServer::writeFile(char const *path, char const *data, size_t dataLen)
 	return success;
 }
 
-bool LocalServer::queue(MessageRef message)
+EntryRef LocalServer::createEntry(
+	SegmentLog::Location const &location, MessageRef message)
 {
-	bool success= false;
-
-	time_t now;
-	time(&now);
+	// Called with the writer lock held
 
-	struct tm nowParts;
-	if (localtime_r(&now, &nowParts) == NULL) {
-		Log::log(LOG_ERROR, "Unable to format time");
-		return false;
+	if (residentBytes + location.length > memoryBudget) {
+		return Entry::Create(location, nullptr);
 	}
 
-	int counter= 1;
-	{
-		std::lock_guard<std::mutex> permit(nameLock);
-		if (now != nameLastTime) {
-			nameCounter= 1;
-			nameLastTime= now;
-		}
-		counter= nameCounter++;
-	}
+	residentBytes+= location.length;
 
-	char fileId[64];
-	sprintf(fileId, "%04d%02d%02d-%02d%02d%02d-%04d",
-		nowParts.tm_year + 1900,
-		nowParts.tm_mon + 1,
-		nowParts.tm_mday,
-		nowParts.tm_hour,
-		nowParts.tm_min,
-		nowParts.tm_sec,
-		counter);
+	return Entry::Create(location, message);
+}
 
-	std::string dataPath= basePath;
-	dataPath.append("/");
-	dataPath.append(fileId);
-	dataPath.append(".hl7");
+bool LocalServer::queue(MessageRef message)
+{
+	bool success= false;
 
 	// We don't attempt to do anything until we're sure the message is
 	// flushed out to disk
 
-	success= writeFile(dataPath.c_str(),
-		message->getData(), message->getDataLen());
-
-	if (success) {
-		Json::Value metaObject= Json::objectValue;
-		metaObject["timestamp"]= (int)message->getTimestamp();
-		metaObject["remoteHost"]= message->getRemoteHost();
-
-		std::string metaData= Json::FastWriter().write(metaObject);
-
-		std::string metaPath= basePath;
-		metaPath.append("/");
-		metaPath.append(fileId);
-		metaPath.append(".meta");
-
-		success= writeFile(metaPath.c_str(),
-			metaData.c_str(), metaData.length());
-
-		if (!success) {
-			if (unlink(dataPath.c_str()) == -1) {
-				Log::log(LOG_ERROR,
-					"Unable to unlink data file %s "
-					"after failing to write meta file %s: %s",
-					dataPath.c_str(), metaPath.c_str(),
-					strerror(errno));
-			}
-		}
-	}
-
-	if (success) {
-		EntryRef entry= std::make_shared<Entry>(fileId, message);
+	SegmentLog::Location location;
+	if (log->append(message, location)) {
+		message->mark(Message::DURABLE);
 
 		std::lock_guard<std::mutex> permit(writerLock);
-		writerQueue.push_back(entry);
+		liveQueue.push_back(createEntry(location, message));
 
 		// Wake up the writer and try to push immediately
 		writerWake.notify_one();
+
+		success= true;
 	}
 
 	return success;
@@ -252,18 +244,19 @@ bool LocalServer::loadMetadata(
 	return success;
 }
 
-void LocalServer::loadQueueDirectory()
-{
-	// This routine is called once at startup to load any dangling files
-	// from the last run into the memory structure.
+#define HAS_DATA 1
+#define HAS_META 2
 
-	std::list<std::string> fileIdList;
+bool LocalServer::scanFiles(
+	std::string const &path, std::map<std::string, int> &files)
+{
+	bool success= false;
 
-	DIR *dir= opendir(basePath.c_str());
+	DIR *dir= opendir(path.c_str());
 	if (dir == NULL) {
 		Log::log(LOG_ERROR,
 			"Unable to scan queue directory %s: %s",
-			basePath.c_str(), strerror(errno));
+			path.c_str(), strerror(errno));
 	} else {
 		struct dirent *de= NULL;
 		while ((de= readdir(dir)) != NULL) {
@@ -275,113 +268,671 @@ void LocalServer::loadQueueDirectory()
 					std::string exten= filename.substr(offset + 1);
 
 					if (exten == "hl7") {
-						fileIdList.push_back(fileId);
+						files[fileId]|= HAS_DATA;
+					} else if (exten == "meta") {
+						files[fileId]|= HAS_META;
 					}
 				}
 			}
 		}
 		closedir(dir);
+
+		success= true;
+	}
+
+	return success;
+}
+
+void LocalServer::removeFile(std::string const &path)
+{
+	if (unlink(path.c_str()) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to remove orphaned file %s: %s",
+			path.c_str(), strerror(errno));
 	}
+}
+
+// Legacy files imported on one sync
+#define IMPORT_BATCH 64
+
+void LocalServer::loadQueueDirectory()
+{
+	// This routine is called once at startup to move any message files
+	// left by older versions into the log.  Older versions also left the
+	// .meta file behind for every message they sent, so those go too.
+
+	std::map<std::string, int> files;
+	scanFiles(basePath, files);
+
+	int orphans= 0;
+
+	std::vector<MessageRef> messages;
+	std::vector<std::string> fileIds;
+
+	// The names start with the time they were written, so going through
+	// them sorted puts them back in the order they came in.
+
+	for (auto const &file : files) {
+		std::string const &fileId= file.first;
 
-	for (std::string fileId : fileIdList) {
 		std::string dataPath;
 		dataPath.append(basePath);
 		dataPath.append(1, '/');
 		dataPath.append(fileId);
 		dataPath.append(".hl7");
 
+		if (!(file.second & HAS_DATA)) {
+			std::string metaPath;
+			metaPath.append(basePath);
+			metaPath.append(1, '/');
+			metaPath.append(fileId);
+			metaPath.append(".meta");
+
+			removeFile(metaPath);
+			orphans++;
+			continue;
+		}
+
 		std::string data;
 		if (readFile(dataPath.c_str(), data)) {
 			time_t timestamp;
 			std::string remoteHost;
 
-			if (!loadMetadata(fileId.c_str(), timestamp, remoteHost)) {
+			if (!(file.second & HAS_META) ||
+				!loadMetadata(fileId.c_str(), timestamp, remoteHost))
+			{
 				timestamp= (time_t)0;
 				remoteHost= "LOST";
 			}
 
 			Log::log(LOG_DEBUG,
-				"Queueing remnant %s from %s at %ul",
-				fileId.c_str(), remoteHost.c_str(), timestamp);
+				"Importing remnant %s from %s at %ld",
+				fileId.c_str(), remoteHost.c_str(), (long)timestamp);
 
+			messages.push_back(Message::Create(
+				timestamp, remoteHost.c_str(), std::move(data), 0));
+			fileIds.push_back(fileId);
 
-			MessageRef message= Message::Create(
-				timestamp, remoteHost.c_str(), data.c_str());
+			if (messages.size() == IMPORT_BATCH) {
+				importBatch(messages, fileIds);
+				messages.clear();
+				fileIds.clear();
+			}
+		}
+	}
 
-			EntryRef entry= Entry::Create(fileId.c_str(), message);
+	if (!messages.empty()) {
+		importBatch(messages, fileIds);
+	}
 
-			std::lock_guard<std::mutex> permit(writerLock);
-			writerQueue.push_back(entry);
+	if (orphans > 0) {
+		Log::log(LOG_INFO,
+			"Removed %d orphaned metadata files from %s",
+			orphans, basePath.c_str());
+	}
+}
+
+void LocalServer::importBatch(
+	std::vector<MessageRef> const &messages,
+	std::vector<std::string> const &fileIds)
+{
+	// The files only go once the records are synced, so a crash in
+	// between sends them twice rather than losing them.  Anything that
+	// didn't make it stays put for the next start.
+
+	std::vector<SegmentLog::Location> locations;
+	log->append(messages, locations);
+
+	{
+		std::lock_guard<std::mutex> permit(writerLock);
+
+		for (size_t i= 0; i < locations.size(); i++) {
+			messages[i]->mark(Message::DURABLE);
+			liveQueue.push_back(createEntry(locations[i], messages[i]));
+		}
+
+		writerWake.notify_one();
+	}
+
+	for (size_t i= 0; i < locations.size(); i++) {
+		std::string dataPath;
+		dataPath.append(basePath);
+		dataPath.append(1, '/');
+		dataPath.append(fileIds[i]);
+		dataPath.append(".hl7");
+
+		std::string metaPath;
+		metaPath.append(basePath);
+		metaPath.append(1, '/');
+		metaPath.append(fileIds[i]);
+		metaPath.append(".meta");
+
+		if (unlink(dataPath.c_str()) == -1) {
+			Log::log(LOG_ERROR,
+				"Unable to remove imported file %s: %s",
+				dataPath.c_str(), strerror(errno));
+		}
+		if ((unlink(metaPath.c_str()) == -1) && (errno != ENOENT)) {
+			Log::log(LOG_ERROR,
+				"Unable to remove imported file %s: %s",
+				metaPath.c_str(), strerror(errno));
 		}
 	}
 }
 
-#define RETRY_TIMEOUT 20
+// First wait before retrying a failed send, in microseconds
+#define RETRY_MIN 1000000
+#define SEND_TIMEOUT 10
+
+// Delivered records marked in one go
+#define DELIVERY_BATCH 64
+
+void LocalServer::addBacklog(EntryRef entry, bool front)
+{
+	// Called with the writer lock held
+
+	if (front) {
+		backlogQueue.push_front(entry);
+	} else {
+		backlogQueue.push_back(entry);
+	}
+
+	// Failed backlog sends coming back are already counted
+	if (!entry->isBacklog()) {
+		entry->setBacklog(true);
+		backlogHosts[entry->getLocation().hostHash]++;
+	}
+}
+
+void LocalServer::demote(std::deque<EntryRef> &failed)
+{
+	// Whatever failed goes back at the head of the backlog in its original
+	// order, and everything new that was waiting joins the end of it, so
+	// new messages keep their lane to themselves once the broker is back.
+
+	std::lock_guard<std::mutex> permit(writerLock);
+
+	for (auto it= failed.rbegin(); it != failed.rend(); ++it) {
+		addBacklog(*it, true);
+	}
+
+	for (EntryRef entry : liveQueue) {
+		addBacklog(entry, false);
+	}
+	liveQueue.clear();
+}
+
+EntryRef LocalServer::takeEntry()
+{
+	// Called with the writer lock held.  While both lanes have something,
+	// the backlog gets backlogShare percent of the sends.
+
+	bool liveReady= !liveQueue.empty();
+	if (liveReady && (backlogShare >= 100)) {
+		liveReady= !recovering && backlogQueue.empty();
+	}
+	if (liveReady && strictOrdering) {
+		// Until recovery is done we can't know who has backlog
+		liveReady= !recovering && (backlogHosts.count(
+			liveQueue.front()->getLocation().hostHash) == 0);
+	}
+
+	bool backlogReady= !backlogQueue.empty();
+
+	bool useBacklog= backlogReady;
+	if (backlogReady && liveReady) {
+		backlogCredit+= backlogShare;
+		if (backlogCredit >= 100) {
+			backlogCredit-= 100;
+		} else {
+			useBacklog= false;
+		}
+	}
+
+	EntryRef entry;
+
+	if (useBacklog) {
+		entry= backlogQueue.front();
+		backlogQueue.pop_front();
+	} else if (liveReady) {
+		entry= liveQueue.front();
+		liveQueue.pop_front();
+	}
+
+	return entry;
+}
+
+void LocalServer::flushDelivered(std::vector<SegmentLog::Location> &delivered)
+{
+	if (!delivered.empty()) {
+		log->markDelivered(delivered);
+		delivered.clear();
+	}
+}
+
+void LocalServer::openQuarantine()
+{
+	if ((mkdir(quarantinePath.c_str(), S_IRWXU|S_IRWXG) == -1) &&
+		(errno != EEXIST))
+	{
+		Log::log(LOG_ERROR,
+			"Unable to create quarantine directory %s: %s",
+			quarantinePath.c_str(), strerror(errno));
+		return;
+	}
+
+	// Whatever was set aside before is still there for someone to look at.
+	// Half a pair is either a message whose record is still live, so it'll
+	// be set aside again, or one someone has already dealt with.
+
+	std::map<std::string, int> files;
+	scanFiles(quarantinePath, files);
+
+	int count= 0;
+	for (auto const &file : files) {
+		std::string fileBase= quarantinePath + "/" + file.first;
+
+		if (file.second == (HAS_DATA|HAS_META)) {
+			count++;
+		} else if (file.second & HAS_DATA) {
+			removeFile(fileBase + ".hl7");
+		} else {
+			removeFile(fileBase + ".meta");
+		}
+	}
+
+	quarantined= count;
+
+	if (count > 0) {
+		Log::log(LOG_WARNING,
+			"%d quarantined messages waiting in %s",
+			count, quarantinePath.c_str());
+	}
+}
+
+// Suffixes tried on a quarantine name before giving up
+#define QUARANTINE_NAMES 100
+
+bool LocalServer::quarantine(EntryRef entry, int attempts)
+{
+	bool success= false;
+
+	MessageRef message= entry->getMessage();
+	if (!message && !log->read(entry->getLocation(), message)) {
+		return false;
+	}
+
+	Json::Value metaObject= Json::objectValue;
+	metaObject["timestamp"]= (int)message->getTimestamp();
+	metaObject["remoteHost"]= message->getRemoteHost();
+	metaObject["attempts"]= attempts;
+
+	std::string metaData= Json::FastWriter().write(metaObject);
+
+	// Sequence numbers can come round again once old segments are retired,
+	// so a name an earlier message already has gets a suffix rather than
+	// being written over.  The record only goes once both files are synced,
+	// so a crash in between just sets it aside again on the next run.
+
+	std::string dataPath;
+	std::string metaPath;
+
+	bool taken= true;
+	for (int i= 0; taken && (i < QUARANTINE_NAMES); i++) {
+		char fileId[48];
+		if (i == 0) {
+			snprintf(fileId, sizeof(fileId), "%016llx",
+				(unsigned long long)entry->getSequence());
+		} else {
+			snprintf(fileId, sizeof(fileId), "%016llx-%d",
+				(unsigned long long)entry->getSequence(), i);
+		}
+
+		dataPath= quarantinePath;
+		dataPath.append(1, '/');
+		dataPath.append(fileId);
+		dataPath.append(".hl7");
+
+		metaPath= quarantinePath;
+		metaPath.append(1, '/');
+		metaPath.append(fileId);
+		metaPath.append(".meta");
+
+		if (writeFile(dataPath.c_str(),
+			message->getData(), message->getDataLen(), taken))
+		{
+			if (writeFile(metaPath.c_str(),
+				metaData.c_str(), metaData.length(), taken))
+			{
+				success= true;
+			} else if (unlink(dataPath.c_str()) == -1) {
+				Log::log(LOG_ERROR,
+					"Unable to unlink quarantined file %s: %s",
+					dataPath.c_str(), strerror(errno));
+			}
+		}
+	}
+
+	if (taken) {
+		Log::log(LOG_ERROR,
+			"No free name in %s for record %llu",
+			quarantinePath.c_str(), (unsigned long long)entry->getSequence());
+	}
+
+	// The new names have to be on disk as well as what's in the files
+	if (success) {
+		int dirFd= open(quarantinePath.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if ((dirFd == -1) || (fsync(dirFd) == -1)) {
+			Log::log(LOG_ERROR,
+				"Unable to sync quarantine directory %s: %s",
+				quarantinePath.c_str(), strerror(errno));
+
+			unlink(dataPath.c_str());
+			unlink(metaPath.c_str());
+			success= false;
+		}
+
+		if (dirFd != -1) {
+			close(dirFd);
+		}
+	}
+
+	if (success) {
+		log->markQuarantined(entry->getLocation());
+		release(entry);
+
+		int count= ++quarantined;
+
+		Log::log(LOG_WARNING,
+			"Quarantined record %llu from %s after %d refusals as %s "
+			"(%d in quarantine)",
+			(unsigned long long)entry->getSequence(),
+			message->getRemoteHost(), attempts, dataPath.c_str(), count);
+	}
+
+	return success;
+}
+
+bool LocalServer::setAside(Outstanding &send)
+{
+	// A send that failed only counts against the message if the broker
+	// refused it, and took something else since it went out - a broker
+	// that's down, or turning everything away, tells us nothing about the
+	// message.
+
+	if ((quarantineAttempts > 0) && send.frame->isRejected() &&
+		(deliveries != send.entry->getTriedAt()))
+	{
+		int attempts= send.entry->addRejection();
+		if (attempts >= quarantineAttempts) {
+			return quarantine(send.entry, attempts);
+		}
+	}
+
+	return false;
+}
 
 void LocalServer::writerLoop()
 {
-	// Load dangling files from a previous run
-	loadQueueDirectory();
+	// Up to forwardWindow sends are kept outstanding upstream, and they're
+	// answered strictly oldest first.  When one fails, whatever else was
+	// outstanding is settled and everything that didn't make it goes back
+	// to the head of the backlog in the same order.
+	//
+	// After a failure the message that failed goes again on its own, and
+	// the window only opens back up once the broker has taken it, so the
+	// ones behind it can't get there first.  A message refused outright
+	// is the exception - it's the others getting through that gets it
+	// quarantined.
+
+	std::deque<Outstanding> outstanding;
+	std::vector<SegmentLog::Location> delivered;
+
+	Backoff backoff(RETRY_MIN, maxBackoff * 1000000L);
+	size_t window= forwardWindow;
 
 	while (run) {
-		EntryRef entry;
-		{
-			std::unique_lock<std::mutex> permit(writerLock);
-			if (!writerQueue.empty()) {
-				entry= writerQueue.front();
-				writerQueue.pop_front();
-			} else {
-				writerWake.wait(permit);
+		while (outstanding.size() < window) {
+			// Might be about to sleep, so retire what's done first
+			if (outstanding.empty()) {
+				flushDelivered(delivered);
+			}
+
+			EntryRef entry;
+			{
+				std::unique_lock<std::mutex> permit(writerLock);
 
-				if (!writerQueue.empty()) {
-					entry= writerQueue.front();
-					writerQueue.pop_front();
+				entry= takeEntry();
+				if (!entry && outstanding.empty() && run) {
+					writerWake.wait(permit);
+					entry= takeEntry();
 				}
 			}
+
+			if (!entry) {
+				break;
+			}
+
+			MessageRef message= entry->getMessage();
+			if (!message && !log->read(entry->getLocation(), message)) {
+				// There's nothing left to send, and recovery would throw
+				// it out after a restart anyway.
+
+				Log::log(LOG_ERROR,
+					"Unable to read back record %llu - dropping it",
+					(unsigned long long)entry->getSequence());
+
+				log->markDelivered(entry->getLocation());
+				release(entry);
+				continue;
+			}
+
+			entry->setTriedAt(deliveries);
+
+			Outstanding send;
+			send.entry= entry;
+			send.frame= upstream->submit(message);
+
+			outstanding.push_back(send);
+		}
+
+		if (outstanding.empty()) {
+			continue;
 		}
 
-		if (entry) {
-			std::string path;
-			path.append(basePath);
-			path.append("/");
-			path.append(entry->getFileId());
-			path.append(".hl7");
+		// About to block on the oldest send, so retire what's done first
+		if (!outstanding.front().frame->isComplete()) {
+			flushDelivered(delivered);
+		}
 
-			if (upstream->queue(entry->getMessage())) {
-				// Message was successfully sent, so delete the backing file
+		Outstanding head= outstanding.front();
+		outstanding.pop_front();
 
-				if (unlink(path.c_str()) == -1) {
-					Log::log(LOG_ERROR,
-						"Unable to clear log file %s: %s",
-						path.c_str(), strerror(errno));
-				}
-			} else {
-				Log::log(LOG_WARNING,
-					"Unable to send %s - waiting %d seconds to retry",
-					entry->getFileId(), RETRY_TIMEOUT);
+		if (head.frame->await(SEND_TIMEOUT)) {
+			backoff.reset();
+			window= forwardWindow;
 
-				{
-					std::lock_guard<std::mutex> permit(writerLock);
-					writerQueue.push_front(entry);
+			delivered.push_back(head.entry->getLocation());
+			release(head.entry);
+			deliveries++;
+
+			if (delivered.size() >= DELIVERY_BATCH) {
+				flushDelivered(delivered);
+			}
+		} else {
+			// Anything the broker did take stays taken, so it isn't sent
+			// twice.  That's settled before deciding what to blame the
+			// failures on, since it shows whether the broker is taking
+			// anything at all.
+
+			std::deque<Outstanding> unsent;
+			unsent.push_back(head);
+
+			for (Outstanding &send : outstanding) {
+				if (send.frame->await(SEND_TIMEOUT)) {
+					delivered.push_back(send.entry->getLocation());
+					release(send.entry);
+					deliveries++;
+				} else {
+					unsent.push_back(send);
+				}
+			}
+			outstanding.clear();
+
+			// The first one left goes again alone unless it was refused
+			std::deque<EntryRef> failed;
+			bool alone= false;
+			for (Outstanding &send : unsent) {
+				if (!setAside(send)) {
+					if (failed.empty()) {
+						alone= !send.frame->isRejected();
+					}
+					failed.push_back(send.entry);
 				}
+			}
 
-				sleep(RETRY_TIMEOUT);
+			flushDelivered(delivered);
+
+			// Nothing to wait for if all that failed was set aside
+			if (failed.empty()) {
+				continue;
 			}
+
+			if (alone) {
+				window= 1;
+			}
+
+			demote(failed);
+
+			long delay= backoff.next();
+
+			Log::log(LOG_WARNING,
+				"Unable to send record %llu - retrying in %ld ms",
+				(unsigned long long)failed.front()->getSequence(), delay / 1000);
+
+			// Only stop() cuts this short - new messages just queue up
+			std::unique_lock<std::mutex> permit(writerLock);
+			writerWake.wait_for(permit, std::chrono::microseconds(delay),
+				[this] { return !run; });
 		}
 	}
+
+	// Whatever is still outstanding stays live in the log, and goes out
+	// again on the next start.
+
+	for (Outstanding &send : outstanding) {
+		if (send.frame->isComplete() && send.frame->await(0)) {
+			delivered.push_back(send.entry->getLocation());
+		}
+	}
+
+	flushDelivered(delivered);
 }
 
-void LocalServer::start()
+void LocalServer::release(EntryRef entry)
 {
+	// Done with it, whether it was delivered or set aside
+
+	if (entry->getMessage() || entry->isBacklog()) {
+		std::lock_guard<std::mutex> permit(writerLock);
+
+		if (entry->getMessage()) {
+			residentBytes-= entry->getLocation().length;
+		}
+
+		if (entry->isBacklog()) {
+			auto found= backlogHosts.find(entry->getLocation().hostHash);
+			if (--found->second == 0) {
+				backlogHosts.erase(found);
+			}
+			entry->setBacklog(false);
+		}
+	}
+}
+
+double LocalServer::oldestAge()
+{
+	// Whatever is at the front of either lane, since they're each in the
+	// order they came in.  Anything already handed upstream isn't counted.
+
+	std::lock_guard<std::mutex> permit(writerLock);
+
+	int64_t oldest= INT64_MAX;
+	if (!backlogQueue.empty()) {
+		oldest= backlogQueue.front()->getLocation().timestamp;
+	}
+	if (!liveQueue.empty()) {
+		oldest= std::min(oldest, liveQueue.front()->getLocation().timestamp);
+	}
+
+	return (oldest == INT64_MAX) ? 0.0 : (double)(time(NULL) - oldest);
+}
+
+bool LocalServer::start()
+{
+	depthGauge.reset(new Gauge("mllp_local_queue_depth", "",
+		"Messages in the local queue waiting to be forwarded",
+		[this]() {
+			std::lock_guard<std::mutex> permit(writerLock);
+			return (double)(liveQueue.size() + backlogQueue.size());
+		}));
+	oldestGauge.reset(new Gauge("mllp_local_queue_oldest_seconds", "",
+		"Age of the oldest message waiting in the local queue",
+		[this]() { return oldestAge(); }));
+	quarantineGauge.reset(new Gauge("mllp_quarantined_messages", "",
+		"Messages set aside in the quarantine directory",
+		[this]() { return (double)quarantined; }));
+
+	// Everything still undelivered from the last run goes out first.
+	// It's indexed in the background, so the writer can start on it and
+	// new messages can be taken while that's going on.
+
+	recovering= true;
+
+	bool opened= log->open(
+		[this](SegmentLog::Location const &location) {
+			std::lock_guard<std::mutex> permit(writerLock);
+			addBacklog(Entry::Create(location, nullptr), false);
+			writerWake.notify_one();
+		},
+		[this]() {
+			std::lock_guard<std::mutex> permit(writerLock);
+			recovering= false;
+			writerWake.notify_one();
+		});
+
+	if (!opened) {
+		// Taking messages we can't keep would just AE every one of them
+		Log::log(LOG_CRITICAL,
+			"Unable to open message log in %s", basePath.c_str());
+
+		return false;
+	}
+
+	openQuarantine();
+	loadQueueDirectory();
+
 	run= true;
 	writerThread= new std::thread(&LocalServer::writerLoop, this);
+
+	return true;
 }
 
 void LocalServer::stop()
 {
-	run= false;
-	writerWake.notify_one();
+	{
+		std::lock_guard<std::mutex> permit(writerLock);
+		run= false;
+		writerWake.notify_one();
+	}
+
 	writerThread->join();
 	delete writerThread;
+
+	log->close();
+
+	depthGauge.reset();
+	oldestGauge.reset();
+	quarantineGauge.reset();
 }
 
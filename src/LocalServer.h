@@ -1,73 +1,215 @@
 class Server;
 typedef std::shared_ptr<Server> ServerRef;
 
+class Gauge;
+
 class Entry {
 public:
-	Entry(char const *fileId, MessageRef message);
+	Entry(SegmentLog::Location const &location, MessageRef message);
 
 	static std::shared_ptr<Entry> Create(
-		char const *fileId, MessageRef message)
+		SegmentLog::Location const &location, MessageRef message)
 	{
-		return std::make_shared<Entry>(fileId, message);
+		return std::make_shared<Entry>(location, message);
 	}
 
 	virtual ~Entry();
 
-	char const *getFileId() {
-		return fileId.c_str();
+	SegmentLog::Location const &getLocation() {
+		return location;
+	}
+	uint64_t getSequence() {
+		return location.sequence;
 	}
 	MessageRef getMessage() {
 		return message;
 	}
 
+	// Counts sends the broker refused outright, not ones that just failed
+	int addRejection() {
+		return ++rejections;
+	}
+
+	// Deliveries the writer had counted when this was last sent
+	uint64_t getTriedAt() {
+		return triedAt;
+	}
+	void setTriedAt(uint64_t deliveries) {
+		triedAt= deliveries;
+	}
+
+	// Counted in backlogHosts until it's delivered or set aside
+	bool isBacklog() {
+		return backlog;
+	}
+	void setBacklog(bool backlog) {
+		this->backlog= backlog;
+	}
+
 private:
-	std::string fileId;
+	SegmentLog::Location location;
 	MessageRef message;
+	int rejections;
+	uint64_t triedAt;
+	bool backlog;
 };
 
 typedef std::shared_ptr<Entry> EntryRef;
 
 class LocalServer : public Server {
+public:
+	struct Options {
+		Options()
+		{
+			segmentSize= 16 * 1024 * 1024;
+			commitDelay= 0;
+			memoryBudget= 64 * 1024 * 1024;
+			forwardWindow= 64;
+			backlogShare= 100;
+			strictOrdering= false;
+			maxBackoff= 60;
+			quarantineAttempts= 5;
+			diskQuota= 0;
+			highWater= 0;
+		}
+
+		// Bytes preallocated for each log segment
+		size_t segmentSize;
+
+		// Microseconds to gather writes before each sync
+		int commitDelay;
+
+		// Bytes of queued message bodies to keep in memory
+		size_t memoryBudget;
+
+		// Sends kept outstanding upstream at once
+		size_t forwardWindow;
+
+		// Percent of sends that go to the backlog while there are new
+		// messages waiting too - 100 means the backlog always goes first
+		int backlogShare;
+
+		// Never send a new message ahead of backlog from the same sender
+		bool strictOrdering;
+
+		// Longest wait before retrying a failed send, in seconds
+		int maxBackoff;
+
+		// Refusals before a message is set aside - 0 never sets one aside
+		int quarantineAttempts;
+
+		// Bytes of segments the log may hold, and how full in percent the
+		// filesystem may get - new messages get AE past either.  0 is no
+		// limit.
+		uint64_t diskQuota;
+		int highWater;
+	};
+
 private:
 	std::string basePath;
 	std::thread *writerThread;
 
 	ServerRef upstream;
+	SegmentLogRef log;
 
-	std::mutex nameLock;
-	int nameCounter;
-	time_t nameLastTime;
-
-	std::deque<EntryRef> writerQueue;
+	// New messages go in the live lane.  The backlog lane holds records
+	// left from the last run, and everything that was waiting when a send
+	// failed.
+	std::deque<EntryRef> liveQueue;
+	std::deque<EntryRef> backlogQueue;
 	std::mutex writerLock;
 	std::condition_variable writerWake;
 
+	bool recovering;
+
+	int backlogShare;
+	int backlogCredit;
+	bool strictOrdering;
+
+	// Backlog entries per sender not yet delivered, by host hash - ones
+	// in flight still count, since they may yet fail and go back
+	std::unordered_map<uint32_t, int> backlogHosts;
+
+	EntryRef takeEntry();
+	void addBacklog(EntryRef entry, bool front);
+	void demote(std::deque<EntryRef> &failed);
+
+	// A send handed upstream and not yet answered
+	struct Outstanding {
+		EntryRef entry;
+		FrameRef frame;
+	};
+
+	size_t forwardWindow;
+	int maxBackoff;
+
+	void flushDelivered(std::vector<SegmentLog::Location> &delivered);
+
+	// Messages the broker keeps refusing are moved out of the log into the
+	// quarantine directory, so they stop holding up the ones behind them.
+	std::string quarantinePath;
+	int quarantineAttempts;
+	std::atomic<int> quarantined;
+
+	// Sends the broker has taken, counted by the writer thread so it can
+	// tell whether anything else got through around a refusal
+	uint64_t deliveries;
+
+	bool setAside(Outstanding &send);
+	bool quarantine(EntryRef entry, int attempts);
+	void openQuarantine();
+	bool writeFile(char const *path, char const *data, size_t dataLen,
+		bool &taken);
+	void release(EntryRef entry);
+
+	size_t memoryBudget;
+	size_t residentBytes;
+
+	EntryRef createEntry(
+		SegmentLog::Location const &location, MessageRef message);
+
 	bool loadMetadata(
 		char const *fileId, time_t &timestamp, std::string &remoteHost);
 
 	void loadQueueDirectory();
+	void importBatch(std::vector<MessageRef> const &messages,
+		std::vector<std::string> const &fileIds);
+
+	// Sampled under the writer lock, which only a scrape pays for
+	std::unique_ptr<Gauge> depthGauge;
+	std::unique_ptr<Gauge> oldestGauge;
+	std::unique_ptr<Gauge> quarantineGauge;
+
+	double oldestAge();
+
+	bool scanFiles(std::string const &path, std::map<std::string, int> &files);
+	void removeFile(std::string const &path);
 
 	volatile bool run;
 
 	bool readFile(char const *path, std::string &data);
-	bool writeFile(char const *path, char const *data, size_t dataLen);
 
 protected:
 	void writerLoop();
 
 public:
-	LocalServer(char const *, ServerRef);
+	LocalServer(char const *, ServerRef, Options const &);
 
-	static ServerRef Create(char const *basePath, ServerRef upstream)
+	static ServerRef Create(
+		char const *basePath, ServerRef upstream, Options const &options)
 	{
-		return std::make_shared<LocalServer>(basePath, upstream);
+		return std::make_shared<LocalServer>(basePath, upstream, options);
 	}
 
 	virtual ~LocalServer();
 
 	virtual bool queue(MessageRef) override;
 
-	virtual void start() override;
+	int getQuarantined() {
+		return quarantined;
+	}
+
+	virtual bool start() override;
 	virtual void stop() override;
 };
 
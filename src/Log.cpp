@@ -1,120 +1,390 @@
-#include <stdio.h>
-#include <errno.h>
-#include <pthread.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <string.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <sys/time.h>
+#include "system.h"
+
 #include <stdarg.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 
+#include "Futex.h"
+#include "RingQueue.h"
 #include "Log.h"
 
 #define FORMAT_BUFFER_LEN 1023
 
+// Records in flight between the callers and the writer thread.  Once
+// they're all taken new messages are counted and dropped rather than
+// making anybody wait.
+#define LOG_RECORDS 1024
+
+// Records handed to a single writev
+#define WRITE_BATCH 64
+
+// Lines a second from any one call site, and how many call sites are
+// tracked - ones that land on the same slot share a limit.
+#define LOG_BURST 10
+#define LIMIT_SLOTS 256
+
+// Microseconds the writer sleeps at most between checks for repeats to
+// report
+#define SWEEP_INTERVAL 1000000
+
+// Messages are formatted on the calling thread into a record from the
+// free ring and passed to the writer thread through the pending ring, so
+// logging never blocks on the file or on another thread.
+
+struct LogRecord {
+	int length;
+	char text[FORMAT_BUFFER_LEN + 1];
+};
+
+std::atomic<int> Log::fd(2);
+std::atomic<int> Log::logLevel(LOG_DEBUG);
 
-pthread_mutex_t Log::lock= PTHREAD_MUTEX_INITIALIZER;
-int Log::fd= 2;
-int Log::logLevel= LOG_DEBUG;
+static RingQueue<LogRecord *> freeRecords(LOG_RECORDS);
+static RingQueue<LogRecord *> pendingRecords(LOG_RECORDS);
+static LogRecord *records= NULL;
+static Signal pendingSignal;
+static std::atomic<bool> running(false);
+static std::atomic<int> writers(0);
+static std::atomic<long> dropped(0);
+static std::thread *writer= NULL;
 
-void Log::open(char const *file)
+// Checked on every call, so the counting is all atomics.  The window is
+// the second it's counting in, in the top half, and the lines so far in
+// the bottom half, so moving on to a new second and counting the first
+// line in it is one step.
+
+struct LogLimit {
+	std::atomic<char const *> format;
+	std::atomic<int> level;
+	std::atomic<uint64_t> window;
+	std::atomic<long> suppressed;
+
+	// The most recent message held back, without its timestamp or level.
+	// Only written by whoever gets the lock without waiting for it.
+	std::mutex lock;
+	char last[FORMAT_BUFFER_LEN + 1];
+};
+
+static LogLimit limits[LIMIT_SLOTS];
+
+void Log::setLogLevel(int l)
 {
-	pthread_mutex_lock(&lock);
+	logLevel= l;
+}
 
-	if (fd != 2) {
-		close(fd);
+// The date and time only change once a second, so each thread keeps the
+// text for the current second and only formats it again when that moves.
+
+static thread_local time_t stampSecond= -1;
+static thread_local char stamp[32];
+static thread_local int stampLen= 0;
+
+static int timestamp(char *buffer)
+{
+	time_t now= time(NULL);
+
+	if (now != stampSecond) {
+		struct tm parts;
+		localtime_r(&now, &parts);
+
+		stampLen= snprintf(stamp, sizeof(stamp),
+			"%04d-%02d-%02d %02d:%02d:%02d ",
+			parts.tm_year + 1900, parts.tm_mon + 1, parts.tm_mday,
+			parts.tm_hour, parts.tm_min, parts.tm_sec);
+		stampSecond= now;
 	}
 
-	if (strcmp(file, "stderr") == 0) {
-		fd= 2;
-	} else {
-		fd= ::open(file,
-			O_CREAT | O_APPEND | O_CLOEXEC | O_WRONLY | O_CLOEXEC,
-			S_IRUSR | S_IWUSR | S_IRGRP);
-		if (fd == -1) {
-			fprintf(stderr, "Error opening log file %s: %d: %s\n",
-				file, errno, strerror(errno));
-			fd= 2;
-		}
+	memcpy(buffer, stamp, stampLen);
+
+	return stampLen;
+}
+
+static char const *levelName(int level)
+{
+	switch (level) {
+	case LOG_DEBUG:
+		return "[DEBUG] ";
+	case LOG_INFO:
+		return "[INFO] ";
+	case LOG_WARNING:
+		return "[WARNING] ";
+	case LOG_ERROR:
+		return "[ERROR] ";
+	case LOG_CRITICAL:
+		return "[ASSERT] ";
+	default:
+		return "[WTF] ";
+	}
+}
+
+static int format(char *buffer, int level, char const *format, va_list args)
+{
+	int length= timestamp(buffer);
+
+	char const *name= levelName(level);
+	size_t nameLen= strlen(name);
+	memcpy(buffer + length, name, nameLen);
+	length+= nameLen;
+
+	// Leaves room for the newline
+	int room= FORMAT_BUFFER_LEN - length;
+	int formatted= vsnprintf(buffer + length, room, format, args);
+	if (formatted > 0) {
+		length+= std::min(formatted, room - 1);
 	}
 
-	pthread_mutex_unlock(&lock);
+	buffer[length++]= '\n';
+	buffer[length]= '\0';
+
+	return length;
 }
 
-void Log::setLogLevel(int l)
+static void writeOut(int out, struct iovec *parts, int count, int total)
 {
-	pthread_mutex_lock(&lock);
-	logLevel= l;
-	pthread_mutex_unlock(&lock);
+	int nwrote= writev(out, parts, count);
+
+	if (nwrote == -1) {
+		fprintf(stderr,
+			"LOG FAILURE: %d: %s\n", errno, strerror(errno));
+	} else if (nwrote != total) {
+		fprintf(stderr,
+			"LOG INCOMPLETE: %d/%d written\n", nwrote, total);
+	}
 }
 
-void Log::log(int level, char const *format, ...)
+static uint32_t windowSecond(uint64_t window)
 {
-	if (level >= logLevel) {
-		char buffer[FORMAT_BUFFER_LEN + 1];
-		int buffer_len;
-
-		struct timeval now;
-		gettimeofday(&now, NULL);
-
-		struct tm *bt= localtime(&now.tv_sec);
-
-		sprintf(buffer, "%04d-%02d-%02d %02d:%02d:%02d ",
-			bt->tm_year + 1900, bt->tm_mon + 1, bt->tm_mday,
-			bt->tm_hour, bt->tm_min, bt->tm_sec);
-
-		char *end= &buffer[strlen(buffer)];
-
-		switch (level) {
-		case LOG_DEBUG:
-			strcpy(end, "[DEBUG]");
-			break;
-		case LOG_INFO:
-			strcpy(end, "[INFO]");
-			break;
-		case LOG_WARNING:
-			strcpy(end, "[WARNING]");
-			break;
-		case LOG_ERROR:
-			strcpy(end, "[ERROR]");
-			break;
-		case LOG_CRITICAL:
-			strcpy(end, "[ASSERT]");
-			break;
-
-		default:
-			strcpy(end, "[WTF]");
-			break;
+	return (uint32_t)(window >> 32);
+}
+
+static bool allow(int level, char const *format, va_list args)
+{
+	if (level >= LOG_CRITICAL) {
+		return true;
+	}
+
+	LogLimit &limit= limits[((uintptr_t)format >> 3) % LIMIT_SLOTS];
+	uint32_t now= (uint32_t)time(NULL);
+
+	char const *owner= limit.format.load(std::memory_order_relaxed);
+	if (owner != format) {
+		// Somebody else's slot - only take it over once what it's holding
+		// back has been reported
+		if ((limit.suppressed.load() == 0) &&
+			limit.format.compare_exchange_strong(owner, format))
+		{
+			limit.level= level;
+			limit.window= ((uint64_t)now << 32) | 1;
+		}
+		return true;
+	}
+
+	uint64_t window= limit.window.load(std::memory_order_relaxed);
+	uint64_t next;
+	do {
+		if (windowSecond(window) == now) {
+			next= window + 1;
+		} else {
+			next= ((uint64_t)now << 32) | 1;
 		}
+	} while (!limit.window.compare_exchange_weak(window, next));
 
+	if ((uint32_t)next <= LOG_BURST) {
+		return true;
+	}
+
+	// Formatted here so the summary shows a real line, not the format.
+	// If someone else is at it already, theirs will do.
+	if (limit.lock.try_lock()) {
+		vsnprintf(limit.last, sizeof(limit.last), format, args);
+		limit.lock.unlock();
+	}
+
+	limit.suppressed++;
+	return false;
+}
+
+void Log::write(int level, char const *format, ...)
+{
+	if (level >= logLevel) {
 		va_list args;
 		va_start(args, format);
 
-		end= &buffer[strlen(buffer)];
-		*(end++)= ' ';
+		// Counted until the record is in the ring, so stop() can wait for
+		// anyone who saw the writer still running
+		writers++;
+
+		// allow() may format the message itself, so it gets its own copy
+		va_list limitArgs;
+		va_copy(limitArgs, args);
+		bool allowed= !running || allow(level, format, limitArgs);
+		va_end(limitArgs);
+
+		if (allowed) {
+			LogRecord *record= NULL;
+			if (running && freeRecords.pop(record)) {
+				record->length= ::format(record->text, level, format, args);
+
+				// Can't fail, there are only as many records as it holds
+				pendingRecords.push(record);
+				pendingSignal.notify();
+			} else if (running) {
+				dropped++;
+			} else {
+				// No writer thread yet, or any more
+				char buffer[FORMAT_BUFFER_LEN + 1];
+				int length= ::format(buffer, level, format, args);
+
+				struct iovec part;
+				part.iov_base= buffer;
+				part.iov_len= length;
+
+				writeOut(fd, &part, 1, length);
+			}
+		}
+
+		writers--;
 
-		buffer_len= FORMAT_BUFFER_LEN - (end - buffer) - (1 /* for NL */);
-		vsnprintf(end, buffer_len, format, args);
-		buffer_len= strlen(buffer);
-		buffer[buffer_len++]= '\n';
-		buffer[buffer_len]= '\0';
 		va_end(args);
+	}
+}
+
+// Reports what was held back - the drop count, and the repeats from any
+// call site whose second is over, or from all of them when stopping.  The
+// drop count goes out once the ring has room again, so it lands in order.
+
+static void writeNotices(int out, bool stopping)
+{
+	static time_t lastSweep= 0;
+
+	std::string notices;
+	char line[FORMAT_BUFFER_LEN + 1];
+
+	long lost= dropped.exchange(0);
+	if (lost > 0) {
+		int length= timestamp(line);
+		snprintf(line + length, sizeof(line) - length,
+			"[WARNING] %ld log messages dropped\n", lost);
+		notices.append(line);
+	}
+
+	time_t now= time(NULL);
+	if (stopping || (now != lastSweep)) {
+		lastSweep= now;
+
+		for (LogLimit &limit : limits) {
+			if ((limit.suppressed > 0) &&
+				(stopping || (windowSecond(limit.window) != (uint32_t)now)))
+			{
+				long repeats= limit.suppressed.exchange(0);
+
+				std::lock_guard<std::mutex> permit(limit.lock);
+
+				int length= timestamp(line);
+				snprintf(line + length, sizeof(line) - length,
+					"%sLast message repeated %ld times: ",
+					levelName(limit.level), repeats);
+				notices.append(line);
+				notices.append(limit.last);
+				notices.append(1, '\n');
+			}
+		}
+	}
+
+	if (!notices.empty()) {
+		struct iovec part;
+		part.iov_base= const_cast<char *>(notices.data());
+		part.iov_len= notices.length();
+
+		writeOut(out, &part, 1, notices.length());
+	}
+}
+
+void Log::writerLoop()
+{
+	LogRecord *batch[WRITE_BATCH];
+	struct iovec parts[WRITE_BATCH];
+
+	for (;;) {
+		int key= pendingSignal.prepare();
 
-		pthread_mutex_lock(&lock);
-		int nwrote= write(fd, buffer, buffer_len);
-		pthread_mutex_unlock(&lock);
+		int count= 0;
+		while ((count < WRITE_BATCH) && pendingRecords.pop(batch[count])) {
+			count++;
+		}
+
+		if (count == 0) {
+			// Only quits once everything queued before stop() is out
+			if (!running) {
+				pendingSignal.finish();
+				writeNotices(fd, true);
+				break;
+			}
+
+			// Comes up at least once a second to report repeats
+			pendingSignal.wait(key, SWEEP_INTERVAL);
+			pendingSignal.finish();
+
+			writeNotices(fd, false);
+			continue;
+		}
+
+		pendingSignal.finish();
+
+		int total= 0;
+		for (int i= 0; i < count; i++) {
+			parts[i].iov_base= batch[i]->text;
+			parts[i].iov_len= batch[i]->length;
+			total+= batch[i]->length;
+		}
+
+		writeOut(fd, parts, count, total);
 
-		if (nwrote == -1) {
-			fprintf(stderr,
-				"LOG FAILURE: %d: %s\n", errno, strerror(errno));
-		} else if (nwrote != buffer_len) {
-			fprintf(stderr,
-				"LOG INCOMPLETE: %d/%d written\n", nwrote, buffer_len);
+		for (int i= 0; i < count; i++) {
+			freeRecords.push(batch[i]);
 		}
+
+		writeNotices(fd, false);
 	}
 }
 
+void Log::start()
+{
+	records= new LogRecord[LOG_RECORDS];
+
+	for (int i= 0; i < LOG_RECORDS; i++) {
+		freeRecords.push(&records[i]);
+	}
+
+	running= true;
+	writer= new std::thread(&Log::writerLoop);
+
+	// So an exit() anywhere still gets out what's queued before it
+	atexit(&Log::stop);
+}
+
+void Log::stop()
+{
+	if (writer != NULL) {
+		running= false;
+
+		while (writers > 0) {
+			std::this_thread::yield();
+		}
+
+		pendingSignal.notify();
+
+		writer->join();
+		delete writer;
+		writer= NULL;
+
+		// The writer can see it stopped and quit before the last of those
+		// records lands, so whatever it left is written out here
+		LogRecord *record;
+		while (pendingRecords.pop(record)) {
+			struct iovec part;
+			part.iov_base= record->text;
+			part.iov_len= record->length;
+
+			writeOut(fd, &part, 1, record->length);
+		}
+	}
+}
@@ -4,16 +4,40 @@
 #define LOG_ERROR		3
 #define LOG_CRITICAL	4
 
+// Anything below this level never gets as far as formatting or the level
+// check - build with CXXFLAGS=-DLOG_MINIMUM_LEVEL=LOG_INFO to drop the debug
+// logging.  The arguments are still worked out at the call site though, so
+// keep anything expensive out of them.
+#ifndef LOG_MINIMUM_LEVEL
+#define LOG_MINIMUM_LEVEL LOG_DEBUG
+#endif
+
 class Log {
 public:
-	static void log(int, char const *, ...);
+	template<typename... Args>
+	static inline void log(int level, char const *format, Args... args)
+	{
+		if (level >= LOG_MINIMUM_LEVEL) {
+			write(level, format, args...);
+		}
+	}
+
+	// Each call site - each format string - gets LOG_BURST lines a second.
+	// Past that they're counted, and the writer thread sums them up with
+	// the last one held back once the second is over.
+	static void write(int, char const *, ...);
 
-	static void open(char const *);
 	static void setLogLevel(int);
 
+	// Between these messages are handed to a writer thread instead of
+	// being written by the caller
+	static void start();
+	static void stop();
+
 private:
-	static pthread_mutex_t lock;
-	static int fd;
-	static int logLevel;
+	static std::atomic<int> fd;
+	static std::atomic<int> logLevel;
+
+	static void writerLoop();
 };
 
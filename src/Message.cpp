@@ -1,14 +1,128 @@
 #include "system.h"
 
 #include "Message.h"
+#include "Metrics.h"
+#include "Log.h"
 
-Message::Message(time_t timestamp, char const *remoteHost, char const *data)
+#define STAGE_HELP "Time for a message to reach each stage from the one before"
+
+// Indexed by stage less one - receiving is always first, so it never has
+// one before it
+static Histogram stageLatency[Message::STAGE_COUNT - 1]= {
+	{ "mllp_stage_seconds", "stage=\"framed\"", STAGE_HELP },
+	{ "mllp_stage_seconds", "stage=\"parsed\"", STAGE_HELP },
+	{ "mllp_stage_seconds", "stage=\"durable\"", STAGE_HELP },
+	{ "mllp_stage_seconds", "stage=\"dequeued\"", STAGE_HELP },
+	{ "mllp_stage_seconds", "stage=\"confirmed\"", STAGE_HELP },
+	{ "mllp_stage_seconds", "stage=\"acknowledged\"", STAGE_HELP }
+};
+
+static Histogram messageLatency("mllp_message_seconds", "",
+	"Time from the first stage of a message to the last");
+
+static char const *stageNames[Message::STAGE_COUNT]= {
+	"received",
+	"framed",
+	"parsed",
+	"durable",
+	"dequeued",
+	"confirmed",
+	"acknowledged"
+};
+
+// In microseconds
+static std::atomic<uint64_t> slowThreshold(0);
+
+Message::Message(time_t timestamp, char const *remoteHost, std::string &&data,
+	uint64_t key)
+	: timestamp(timestamp), remoteHost(remoteHost), data(std::move(data)),
+	key(key)
 {
-	this->timestamp= timestamp;
-	this->remoteHost= remoteHost;
-	this->data= data;
+	for (std::atomic<uint64_t> &stage : stages) {
+		stage.store(0, std::memory_order_relaxed);
+	}
 }
 
 Message::~Message()
 {
+	report();
+}
+
+void Message::mark(Stage stage)
+{
+	mark(stage, Metrics::now());
+}
+
+void Message::mark(Stage stage, uint64_t at)
+{
+	stages[stage].store(at, std::memory_order_relaxed);
+}
+
+void Message::setSlowThreshold(int millis)
+{
+	slowThreshold= (uint64_t)millis * 1000;
+}
+
+void Message::report()
+{
+	// Only what was stamped, put in the order it happened, keeping the
+	// stage order for ties
+
+	struct Stamp {
+		int stage;
+		uint64_t at;
+	};
+
+	Stamp stamps[STAGE_COUNT];
+	int count= 0;
+
+	for (int stage= 0; stage < STAGE_COUNT; stage++) {
+		uint64_t when= stages[stage].load(std::memory_order_relaxed);
+		if (when == 0) {
+			continue;
+		}
+
+		int i= count++;
+		for (; (i > 0) && (stamps[i - 1].at > when); i--) {
+			stamps[i]= stamps[i - 1];
+		}
+		stamps[i].stage= stage;
+		stamps[i].at= when;
+	}
+
+	if (count < 2) {
+		return;
+	}
+
+	// Each stage is timed from the stamped one before it.  Receiving has
+	// no histogram, since it only ever comes first when it's there at all.
+
+	for (int i= 1; i < count; i++) {
+		Stamp const &previous= stamps[i - 1];
+		Stamp const &current= stamps[i];
+
+		if (current.stage != RECEIVED) {
+			stageLatency[current.stage - 1].record(current.at - previous.at);
+		}
+	}
+
+	uint64_t total= stamps[count - 1].at - stamps[0].at;
+	messageLatency.record(total);
+
+	uint64_t threshold= slowThreshold.load(std::memory_order_relaxed);
+	if ((threshold > 0) && (total >= threshold)) {
+		std::string breakdown;
+		char part[48];
+
+		for (int i= 1; i < count; i++) {
+			snprintf(part, sizeof(part), "%s%s %.1f",
+				(i > 1) ? ", " : "", stageNames[stamps[i].stage],
+				(stamps[i].at - stamps[i - 1].at) / 1000.0);
+			breakdown.append(part);
+		}
+
+		Log::log(LOG_WARNING,
+			"Slow message from %s: %.1f ms - %s",
+			remoteHost.c_str(), total / 1000.0, breakdown.c_str());
+	}
 }
@@ -1,40 +1,89 @@
+// A received message.  The body is moved in once when the message is
+// framed and never changes after that, so everything downstream shares
+// the one buffer through a MessageRef instead of copying it.
+//
+// Each message also notes when it reached each stage on its way through,
+// and when the last reference goes the time between them is added to the
+// stage histograms.  Messages slower than the threshold are logged.
+
 class Message {
 public:
 	Message(
 		time_t timestamp,
 		char const *remoteHost,
-		char const *data);
+		std::string &&data,
+		uint64_t key);
+
+	// Stages are stamped on the Metrics clock, and the time taken by
+	// each is measured from whichever stamped stage came just before it -
+	// with a local queue the ACK goes out before the broker has it,
+	// without one after.
+	enum Stage {
+		RECEIVED,	// first byte of the frame
+		FRAMED,		// end of the frame
+		PARSED,
+		DURABLE,	// synced to the local queue
+		DEQUEUED,	// taken by the broker sender
+		CONFIRMED,	// taken by the broker
+		ACKNOWLEDGED,
+		STAGE_COUNT
+	};
 
 	static std::shared_ptr<Message> Create(
 		time_t timestamp,
 		char const *remoteHost,
-		char const *data)
+		std::string &&data,
+		uint64_t key)
 	{
-		return std::make_shared<Message>(timestamp, remoteHost, data);
+		return std::make_shared<Message>(
+			timestamp, remoteHost, std::move(data), key);
 	}
 
 
 	virtual ~Message();
 
-	char const *getData() {
-		return data.c_str();
+	char const *getData() const {
+		return data.data();
 	}
-	size_t getDataLen() {
+	size_t getDataLen() const {
 		return data.length();
 	}
+	std::string const &getDataString() const {
+		return data;
+	}
 
-	time_t getTimestamp() {
+	time_t getTimestamp() const {
 		return timestamp;
 	}
 
-	char const *getRemoteHost() {
+	char const *getRemoteHost() const {
 		return remoteHost.c_str();
 	}
 
+	// Hash of the sender and control ID, the same for every resend of the
+	// message - 0 if it isn't known
+	uint64_t getKey() const {
+		return key;
+	}
+
+	void mark(Stage stage);
+	void mark(Stage stage, uint64_t at);
+
+	// Messages taking longer than this from first stage to last are
+	// logged - 0 logs none
+	static void setSlowThreshold(int millis);
+
 private:
-	time_t timestamp;
-	std::string remoteHost;
-	std::string data;
+	time_t const timestamp;
+	std::string const remoteHost;
+	std::string const data;
+	uint64_t const key;
+
+	// Stamped from whichever thread has the message at the time - 0 until
+	// the stage is reached
+	std::atomic<uint64_t> stages[STAGE_COUNT];
+
+	void report();
 };
 
 typedef std::shared_ptr<Message> MessageRef;
@@ -0,0 +1,120 @@
+#include "system.h"
+
+#include "MessageScan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MESSAGESCAN_X86
+#endif
+
+static size_t findInvalidScalar(char const *data, size_t dataLen)
+{
+	size_t i= 0;
+	for (; i < dataLen; i++) {
+		unsigned char c= (unsigned char)data[i];
+		if ((c != 0x0D) && ((c < 0x20) || (c > 0x7F))) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+#ifdef MESSAGESCAN_X86
+
+// The compares are signed, so 0x80-0xFF come out negative and fail the
+// greater-than-0x1F test right along with the control characters.
+
+__attribute__((target("sse2")))
+static size_t findInvalidSse2(char const *data, size_t dataLen)
+{
+	__m128i cr= _mm_set1_epi8(0x0D);
+	__m128i low= _mm_set1_epi8(0x1F);
+
+	size_t i= 0;
+	for (; (i + 16) <= dataLen; i+= 16) {
+		__m128i chunk= _mm_loadu_si128(
+			reinterpret_cast<__m128i const *>(data + i));
+
+		__m128i valid= _mm_or_si128(
+			_mm_cmpgt_epi8(chunk, low),
+			_mm_cmpeq_epi8(chunk, cr));
+
+		unsigned int mask= (unsigned int)_mm_movemask_epi8(valid);
+		if (mask != 0xFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+
+	return i + findInvalidScalar(data + i, dataLen - i);
+}
+
+__attribute__((target("avx2")))
+static size_t findInvalidAvx2(char const *data, size_t dataLen)
+{
+	__m256i cr= _mm256_set1_epi8(0x0D);
+	__m256i low= _mm256_set1_epi8(0x1F);
+
+	size_t i= 0;
+	for (; (i + 32) <= dataLen; i+= 32) {
+		__m256i chunk= _mm256_loadu_si256(
+			reinterpret_cast<__m256i const *>(data + i));
+
+		__m256i valid= _mm256_or_si256(
+			_mm256_cmpgt_epi8(chunk, low),
+			_mm256_cmpeq_epi8(chunk, cr));
+
+		unsigned int mask= (unsigned int)_mm256_movemask_epi8(valid);
+		if (mask != 0xFFFFFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+
+	return i + findInvalidSse2(data + i, dataLen - i);
+}
+
+#endif
+
+typedef size_t (*ScanFunction)(char const *, size_t);
+
+struct ScanImplementation {
+	ScanFunction function;
+	char const *name;
+};
+
+static ScanImplementation pickImplementation()
+{
+	ScanImplementation implementation;
+	implementation.function= findInvalidScalar;
+	implementation.name= "scalar";
+
+#ifdef MESSAGESCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		implementation.function= findInvalidAvx2;
+		implementation.name= "AVX2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		implementation.function= findInvalidSse2;
+		implementation.name= "SSE2";
+	}
+#endif
+
+	return implementation;
+}
+
+static ScanImplementation const &getScanImplementation()
+{
+	static ScanImplementation implementation= pickImplementation();
+	return implementation;
+}
+
+size_t MessageScan::findInvalid(char const *data, size_t dataLen)
+{
+	return getScanImplementation().function(data, dataLen);
+}
+
+char const *MessageScan::getImplementation()
+{
+	return getScanImplementation().name;
+}
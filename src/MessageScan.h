@@ -0,0 +1,12 @@
+// Character class checks for message bodies.  The vector versions are
+// picked at startup based on what the CPU supports.
+
+class MessageScan {
+public:
+	// Returns the offset of the first byte that isn't allowed in an HL7
+	// message body, or dataLen if they're all good.  Allowed is CR or
+	// anything from 0x20 to 0x7F.
+	static size_t findInvalid(char const *data, size_t dataLen);
+
+	static char const *getImplementation();
+};
@@ -0,0 +1,274 @@
+#include "system.h"
+
+#include "Metrics.h"
+
+// Kept in a function so metrics defined as statics in other files can
+// register during static initialization, whatever order that runs in.
+
+struct Registry {
+	std::mutex lock;
+	std::list<Metric *> metrics;
+};
+
+static Registry &registry()
+{
+	static Registry instance;
+	return instance;
+}
+
+void Metrics::add(Metric *metric)
+{
+	Registry &r= registry();
+
+	std::lock_guard<std::mutex> permit(r.lock);
+	r.metrics.push_back(metric);
+}
+
+void Metrics::remove(Metric *metric)
+{
+	Registry &r= registry();
+
+	std::lock_guard<std::mutex> permit(r.lock);
+	r.metrics.remove(metric);
+}
+
+uint64_t Metrics::now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string Metrics::render()
+{
+	Registry &r= registry();
+
+	std::lock_guard<std::mutex> permit(r.lock);
+
+	// Grouped by name, since each name only gets one HELP and TYPE
+	std::map<std::string, std::vector<Metric *>> groups;
+	for (Metric *metric : r.metrics) {
+		groups[metric->getName()].push_back(metric);
+	}
+
+	std::string out;
+
+	for (auto const &group : groups) {
+		Metric *first= group.second.front();
+
+		out.append("# HELP ");
+		out.append(group.first);
+		out.append(1, ' ');
+		out.append(first->getHelp());
+		out.append("\n# TYPE ");
+		out.append(group.first);
+		out.append(1, ' ');
+		out.append(first->getType());
+		out.append(1, '\n');
+
+		// Gauges reporting the same series are summed
+		std::map<std::string, double> gauges;
+
+		for (Metric *metric : group.second) {
+			Gauge *gauge= dynamic_cast<Gauge *>(metric);
+			if (gauge != NULL) {
+				gauges[gauge->getLabels()]+= gauge->sample();
+			} else {
+				metric->render(out);
+			}
+		}
+
+		for (auto const &gauge : gauges) {
+			Metric::renderLine(out, group.first.c_str(),
+				gauge.first.c_str(), NULL, gauge.second);
+		}
+	}
+
+	return out;
+}
+
+Metric::Metric(char const *name, char const *labels, char const *help)
+{
+	this->name= name;
+	this->labels= labels;
+	this->help= help;
+}
+
+Metric::~Metric()
+{
+}
+
+int Metric::shard()
+{
+	static std::atomic<int> nextShard(0);
+	static thread_local int index= nextShard++ % METRIC_SHARDS;
+
+	return index;
+}
+
+void Metric::renderLine(std::string &out, char const *name,
+	char const *labels, char const *extraLabel, double value)
+{
+	out.append(name);
+
+	bool hasLabels= (labels[0] != '\0');
+	if (hasLabels || (extraLabel != NULL)) {
+		out.append(1, '{');
+		out.append(labels);
+		if (extraLabel != NULL) {
+			if (hasLabels) {
+				out.append(1, ',');
+			}
+			out.append(extraLabel);
+		}
+		out.append(1, '}');
+	}
+
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), " %.15g\n", value);
+	out.append(buffer);
+}
+
+Counter::Counter(char const *name, char const *labels, char const *help)
+	: Metric(name, labels, help)
+{
+	for (Shard &shard : shards) {
+		shard.value.store(0, std::memory_order_relaxed);
+	}
+
+	Metrics::add(this);
+}
+
+Counter::~Counter()
+{
+	Metrics::remove(this);
+}
+
+uint64_t Counter::total()
+{
+	uint64_t total= 0;
+	for (Shard &shard : shards) {
+		total+= shard.value.load(std::memory_order_relaxed);
+	}
+
+	return total;
+}
+
+void Counter::render(std::string &out)
+{
+	renderLine(out, getName(), getLabels(), NULL, (double)total());
+}
+
+Histogram::Histogram(char const *name, char const *labels, char const *help)
+	: Metric(name, labels, help)
+{
+	for (Shard &shard : shards) {
+		for (std::atomic<uint64_t> &count : shard.buckets) {
+			count.store(0, std::memory_order_relaxed);
+		}
+		shard.sum.store(0, std::memory_order_relaxed);
+	}
+
+	Metrics::add(this);
+}
+
+Histogram::~Histogram()
+{
+	Metrics::remove(this);
+}
+
+int Histogram::bucket(uint64_t micros)
+{
+	// The first four take one value each, then each power of two from 4
+	// up is split in four by the two bits below the top one.
+
+	if (micros < 4) {
+		return (int)micros;
+	}
+
+	int power= 63 - __builtin_clzll(micros);
+	int index= ((power - 1) * 4) + (int)((micros >> (power - 2)) & 3);
+
+	return std::min(index, HISTOGRAM_BUCKETS - 1);
+}
+
+uint64_t Histogram::bucketLimit(int bucket)
+{
+	// Largest value that lands in the bucket
+
+	if (bucket < 4) {
+		return bucket;
+	}
+
+	int power= (bucket / 4) + 1;
+	uint64_t lower= (uint64_t)(4 + (bucket % 4)) << (power - 2);
+
+	return lower + ((uint64_t)1 << (power - 2)) - 1;
+}
+
+void Histogram::record(uint64_t micros)
+{
+	Shard &mine= shards[shard()];
+
+	mine.buckets[bucket(micros)].fetch_add(1, std::memory_order_relaxed);
+	mine.sum.fetch_add(micros, std::memory_order_relaxed);
+}
+
+void Histogram::render(std::string &out)
+{
+	uint64_t counts[HISTOGRAM_BUCKETS]= { 0 };
+	uint64_t sum= 0;
+
+	for (Shard &shard : shards) {
+		for (int i= 0; i < HISTOGRAM_BUCKETS; i++) {
+			counts[i]+= shard.buckets[i].load(std::memory_order_relaxed);
+		}
+		sum+= shard.sum.load(std::memory_order_relaxed);
+	}
+
+	std::string bucketName= getName();
+	bucketName.append("_bucket");
+
+	char le[48];
+
+	// The last bucket takes everything past the others, so it only shows
+	// up as +Inf
+	uint64_t cumulative= 0;
+	for (int i= 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+		cumulative+= counts[i];
+
+		snprintf(le, sizeof(le), "le=\"%.6f\"", bucketLimit(i) / 1e6);
+		renderLine(out, bucketName.c_str(), getLabels(), le,
+			(double)cumulative);
+	}
+	cumulative+= counts[HISTOGRAM_BUCKETS - 1];
+
+	renderLine(out, bucketName.c_str(), getLabels(), "le=\"+Inf\"",
+		(double)cumulative);
+
+	std::string sumName= getName();
+	sumName.append("_sum");
+	renderLine(out, sumName.c_str(), getLabels(), NULL, sum / 1e6);
+
+	std::string countName= getName();
+	countName.append("_count");
+	renderLine(out, countName.c_str(), getLabels(), NULL, (double)cumulative);
+}
+
+Gauge::Gauge(char const *name, char const *labels, char const *help,
+	SampleFunction sample)
+	: Metric(name, labels, help)
+{
+	sampleFunction= sample;
+
+	Metrics::add(this);
+}
+
+Gauge::~Gauge()
+{
+	Metrics::remove(this);
+}
+
+void Gauge::render(std::string &out)
+{
+	renderLine(out, getName(), getLabels(), NULL, sample());
+}
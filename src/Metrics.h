@@ -0,0 +1,137 @@
+// Counters and histograms for the metrics endpoint.  Each one is split
+// into shards on their own cache lines, and every thread sticks to one
+// shard, so bumping one on the message path is a relaxed add nobody else
+// is fighting over.  The shards are only added up when they're scraped.
+//
+// Gauges are sampled when they're scraped, by a function handed in when
+// they're made.  Gauges with the same name and labels are added together,
+// so each of several servers can report its own part of the total.
+//
+// Metrics register themselves when they're made and drop out when
+// they're destroyed.  Counters and histograms are meant to be static.
+
+#define METRIC_SHARDS 16
+
+class Metric {
+public:
+	Metric(char const *name, char const *labels, char const *help);
+	virtual ~Metric();
+
+	char const *getName() const {
+		return name;
+	}
+	char const *getLabels() const {
+		return labels;
+	}
+	char const *getHelp() const {
+		return help;
+	}
+
+	virtual char const *getType() const = 0;
+
+	// Appends the sample lines in Prometheus text format
+	virtual void render(std::string &out) = 0;
+
+protected:
+	friend class Metrics;
+
+	static int shard();
+
+	static void renderLine(std::string &out, char const *name,
+		char const *labels, char const *extraLabel, double value);
+
+private:
+	char const *name;
+	char const *labels;
+	char const *help;
+};
+
+class Counter : public Metric {
+public:
+	Counter(char const *name, char const *labels, char const *help);
+	virtual ~Counter();
+
+	void add(uint64_t count= 1) {
+		shards[shard()].value.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	uint64_t total();
+
+	virtual char const *getType() const override {
+		return "counter";
+	}
+	virtual void render(std::string &out) override;
+
+private:
+	struct alignas(64) Shard {
+		std::atomic<uint64_t> value;
+	};
+
+	Shard shards[METRIC_SHARDS];
+};
+
+// Log-linear buckets over microseconds - four to each power of two, so a
+// bucket is never more than a quarter wider than the values in it.
+#define HISTOGRAM_POWERS 32
+#define HISTOGRAM_BUCKETS (4 * HISTOGRAM_POWERS)
+
+class Histogram : public Metric {
+public:
+	Histogram(char const *name, char const *labels, char const *help);
+	virtual ~Histogram();
+
+	void record(uint64_t micros);
+
+	virtual char const *getType() const override {
+		return "histogram";
+	}
+
+	// Buckets go out in seconds, as Prometheus expects
+	virtual void render(std::string &out) override;
+
+private:
+	struct alignas(64) Shard {
+		std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+		std::atomic<uint64_t> sum;
+	};
+
+	Shard shards[METRIC_SHARDS];
+
+	static int bucket(uint64_t micros);
+	static uint64_t bucketLimit(int bucket);
+};
+
+class Gauge : public Metric {
+public:
+	typedef std::function<double()> SampleFunction;
+
+	Gauge(char const *name, char const *labels, char const *help,
+		SampleFunction sample);
+	virtual ~Gauge();
+
+	double sample() {
+		return sampleFunction();
+	}
+
+	virtual char const *getType() const override {
+		return "gauge";
+	}
+	virtual void render(std::string &out) override;
+
+private:
+	SampleFunction sampleFunction;
+};
+
+class Metrics {
+public:
+	// Everything registered, in Prometheus text format
+	static std::string render();
+
+	// Microseconds on the monotonic clock, for timing things
+	static uint64_t now();
+
+	// Called by each kind of metric once it's fully built, and before
+	// it's taken apart, since a scrape can come in at any time
+	static void add(Metric *);
+	static void remove(Metric *);
+};
@@ -0,0 +1,27 @@
+#include "system.h"
+
+#include "Listener.h"
+#include "MetricsListener.h"
+
+#include "EventLoop.h"
+#include "Connection.h"
+#include "TcpConnection.h"
+#include "HttpConnection.h"
+
+MetricsListener::MetricsListener(int family, int port, EventLoopRef loop)
+	: Listener(family, port)
+{
+	this->loop= loop;
+}
+
+MetricsListener::~MetricsListener()
+{
+}
+
+ConnectionRef MetricsListener::connect(int sock, char const *remoteHost)
+{
+	return std::make_shared<HttpConnection>(
+		shared_from_this(),
+		loop,
+		sock);
+}
@@ -0,0 +1,24 @@
+class Connection;
+typedef std::shared_ptr<Connection> ConnectionRef;
+
+class EventLoop;
+typedef std::shared_ptr<EventLoop> EventLoopRef;
+
+// Serves the metrics in Prometheus text format at /metrics
+
+class MetricsListener : public Listener {
+public:
+	MetricsListener(int family, int port, EventLoopRef loop);
+	virtual ~MetricsListener();
+
+	static ListenerRef Create(int family, int port, EventLoopRef loop)
+	{
+		return std::make_shared<MetricsListener>(family, port, loop);
+	}
+
+protected:
+	virtual ConnectionRef connect(int sock, char const *remoteHost);
+
+private:
+	EventLoopRef loop;
+};
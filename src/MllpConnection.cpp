@@ -1,25 +1,59 @@
 #include "system.h"
 
+#include "EventLoop.h"
 #include "Connection.h"
 #include "TcpConnection.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+#include "MllpFramer.h"
 #include "MllpConnection.h"
 
 #include "Message.h"
 #include "Server.h"
 
+#include "Metrics.h"
 #include "Log.h"
 
+// Seconds the server has to answer before the sender gets an AE
+#define ACK_TIMEOUT 10
+
+static Counter connectionsOpened("mllp_connections_opened_total", "",
+	"MLLP connections accepted");
+static Counter connectionsClosed("mllp_connections_closed_total", "",
+	"MLLP connections closed");
+static Gauge connectionsActive("mllp_connections_active", "",
+	"MLLP connections open now",
+	[]() {
+		return (double)(connectionsOpened.total() - connectionsClosed.total());
+	});
+
+static Counter messagesReceived("mllp_messages_received_total", "",
+	"Messages received");
+static Counter bytesReceived("mllp_received_bytes_total", "",
+	"Bytes of messages received");
+
+static Counter acksAccepted("mllp_acks_total", "type=\"AA\"",
+	"Acknowledgements sent, by type");
+static Counter acksError("mllp_acks_total", "type=\"AE\"",
+	"Acknowledgements sent, by type");
+static Counter acksRejected("mllp_acks_total", "type=\"AR\"",
+	"Acknowledgements sent, by type");
+
 MllpConnection::MllpConnection(
 	ListenerRef listener,
+	EventLoopRef loop,
 	int sock,
 	ServerRef server,
 	char const *remoteHost)
-	: TcpConnection(listener, sock)
+	: TcpConnection(listener, loop, sock)
 {
 	this->server= server;
 	this->remoteHost= remoteHost;
 
-	mllpState= MllpState::WAIT_SB;
+	messageKey= 0;
+
+	connectionsOpened.add();
 }
 
 MllpConnection::~MllpConnection()
@@ -29,80 +63,145 @@ MllpConnection::~MllpConnection()
 bool MllpConnection::handleData(char const *data, int dataLen)
 {
 	bool valid= true;
-	for (int i= 0; valid && (i < dataLen); i++) {
-		char c= data[i];
-
-		switch (mllpState) {
-		case MllpState::WAIT_SB:
-			if (c != 0x0B) {
-				Log::log(LOG_ERROR,
-					"Char received other than SB");
-				valid= false;
-			} else {
-				mllpState= MllpState::READ_MESSAGE;
-			}
-			break;
 
-		case MllpState::READ_MESSAGE:
-			if (c == 0x1C) {
-				mllpState= MllpState::WAIT_CR;
-			} else if ((c == 0x0D) || ((c > 0x1F) && (c <= 0x7F))) {
-				mllpMessage.append(1, c);
+	char const *end= data + dataLen;
+	char const *next= data;
+	while (valid && !pendingFrame && (next < end)) {
+		size_t used;
+		MllpFramer::Result result= framer.frame(next, end - next, used);
+		next+= used;
+
+		if (result == MllpFramer::Result::INVALID) {
+			valid= false;
+		} else if (result == MllpFramer::Result::MESSAGE) {
+			if (handleMessage()) {
+				framer.next();
 			} else {
 				Log::log(LOG_ERROR,
-					"Invalid character %02X received in message",
-					c);
+					"Failed to process MLLP message");
 				valid= false;
 			}
-			break;
-
-		case MllpState::WAIT_CR:
-			if (c == 0x0D) {
-				if (handleMessage(mllpMessage.c_str())) {
-					mllpState= MllpState::WAIT_SB;
-
-					mllpMessage.clear();
-				} else {
-					Log::log(LOG_ERROR,
-						"Failed to process MLLP message");
-					valid= false;
-				}
-			} else {
-				Log::log(LOG_ERROR,
-					"Expected CR after EB missing");
-
-				valid= false;
-			}
-			break;
 		}
 	}
 
+	if (valid && pendingFrame) {
+		pendingInput.assign(next, end - next);
+	}
+
 	return valid;
 }
 
 void MllpConnection::handleEof()
 {
+	// Nobody is left to tell, so don't let it hold anything up
+	if (pendingFrame) {
+		pendingFrame->abandon();
+		pendingFrame= nullptr;
+	}
+
+	connectionsClosed.add();
+}
+
+bool MllpConnection::handleWake()
+{
+	bool valid= true;
+
+	if (pendingFrame && pendingFrame->isComplete()) {
+		setTimer(0);
+		resume();
+
+		if (finishMessage()) {
+			std::string input;
+			input.swap(pendingInput);
+
+			valid= handleData(input.data(), input.length());
+		} else {
+			Log::log(LOG_ERROR,
+				"Failed to process MLLP message");
+			valid= false;
+		}
+	}
+
+	return valid;
+}
+
+bool MllpConnection::handleTimer()
+{
+	// Only gives up if the answer didn't just show up - if it did, the
+	// wake is on its way and this goes the same way anyhow.
+	if (pendingFrame && pendingFrame->abandon()) {
+		Log::log(LOG_WARNING,
+			"Timeout waiting for server to take message from %s",
+			remoteHost.c_str());
+	}
+
+	return handleWake();
 }
 
-bool MllpConnection::handleMessage(char const *data)
+bool MllpConnection::handleMessage()
 {
 	bool success= false;
 
-	if (parse(data)) {
+	uint64_t framedAt= Metrics::now();
+
+	std::string &mllpMessage= framer.getMessage();
+
+	messagesReceived.add();
+	bytesReceived.add(mllpMessage.length());
+
+	if (parse(mllpMessage.data(), mllpMessage.length())) {
 		time_t now;
 		time(&now);
 
-		MessageRef message= Message::Create(now, remoteHost.c_str(), data);
-		if (server->queue(message)) {
-			acknowledge(AckType::ACCEPT);
-			success= true;
+		// Moves the buffer, so mllpMessage is empty after this
+		MessageRef message= Message::Create(
+			now, remoteHost.c_str(), std::move(mllpMessage), messageKey);
+
+		message->mark(Message::RECEIVED, framer.getReceivedAt());
+		message->mark(Message::FRAMED, framedAt);
+		message->mark(Message::PARSED);
+
+		// The answer comes back on a loop thread through the stop pipe,
+		// so this one isn't held up waiting on the broker.
+
+		std::weak_ptr<Connection> weak= shared_from_this();
+
+		pendingFrame= server->submit(message, [weak](bool) {
+			std::shared_ptr<Connection> connection= weak.lock();
+			if (connection) {
+				std::static_pointer_cast<MllpConnection>(connection)->wake();
+			}
+		});
+
+		if (pendingFrame->isComplete()) {
+			success= finishMessage();
 		} else {
-			acknowledge(AckType::ERROR);
+			setTimer(ACK_TIMEOUT);
+			pause();
+			success= true;
 		}
 	} else {
 		acknowledge(AckType::REJECT);
+		acksRejected.add();
 	}
 
 	return success;
 }
 
+bool MllpConnection::finishMessage()
+{
+	bool success= pendingFrame->isSucceeded();
+
+	if (success) {
+		acknowledge(AckType::ACCEPT);
+		acksAccepted.add();
+	} else {
+		acknowledge(AckType::ERROR);
+		acksError.add();
+	}
+
+	pendingFrame->getMessage()->mark(Message::ACKNOWLEDGED);
+	pendingFrame= nullptr;
+
+	return success;
+}
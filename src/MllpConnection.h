@@ -7,6 +7,7 @@ class MllpConnection
 public:
 	MllpConnection(
 		ListenerRef listener,
+		EventLoopRef loop,
 		int sock,
 		ServerRef server,
 		char const *remoteHost);
@@ -22,25 +23,31 @@ public:
 protected:
 	virtual bool handleData(char const *data, int dataLen) override;
 	virtual void handleEof() override;
+	virtual bool handleWake() override;
+	virtual bool handleTimer() override;
 
 protected:
-	virtual bool parse(char const *message) = 0;
+	virtual bool parse(char const *message, size_t messageLen) = 0;
 	virtual void acknowledge(AckType) = 0;
 
+	// Set by parse() to tell resends of the same message apart from new
+	// ones, or 0 if there's no telling
+	uint64_t messageKey;
+
 private:
 	ServerRef server;
 
 	std::string remoteHost;
 
-	enum class MllpState {
-		WAIT_SB,
-		READ_MESSAGE,
-		WAIT_CR
-	};
+	MllpFramer framer;
 
-	MllpState mllpState;
-	std::string mllpMessage;
+	// The message waiting on the server for its answer.  Nothing more is
+	// read until it's acknowledged, and whatever was read past the end of
+	// it is kept to be framed after that.
+	FrameRef pendingFrame;
+	std::string pendingInput;
 
-	bool handleMessage(char const *message);
+	bool handleMessage();
+	bool finishMessage();
 };
 
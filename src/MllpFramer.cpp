@@ -0,0 +1,93 @@
+#include "system.h"
+
+#include "MessageScan.h"
+#include "MllpFramer.h"
+
+#include "Metrics.h"
+#include "Log.h"
+
+MllpFramer::MllpFramer()
+{
+	state= State::WAIT_SB;
+	lastMessageLen= 0;
+	receivedAt= 0;
+}
+
+MllpFramer::Result MllpFramer::frame(
+	char const *data, size_t dataLen, size_t &used)
+{
+	Result result= Result::PARTIAL;
+
+	char const *end= data + dataLen;
+	char const *next= data;
+	while ((result == Result::PARTIAL) && (next < end)) {
+		char c= *next;
+
+		switch (state) {
+		case State::WAIT_SB:
+			if (c != 0x0B) {
+				Log::log(LOG_ERROR,
+					"Char received other than SB");
+				result= Result::INVALID;
+			} else {
+				state= State::READ_MESSAGE;
+				receivedAt= Metrics::now();
+			}
+			next++;
+			break;
+
+		case State::READ_MESSAGE:
+			{
+				// Jump straight to the end block if it's in this read, and
+				// take everything before it as one span.
+
+				char const *block= static_cast<char const *>(
+					memchr(next, 0x1C, end - next));
+
+				size_t spanLen= ((block != NULL) ? block : end) - next;
+
+				size_t invalid= MessageScan::findInvalid(next, spanLen);
+				if (invalid < spanLen) {
+					Log::log(LOG_ERROR,
+						"Invalid character %02X received in message "
+						"at offset %zu",
+						(unsigned char)next[invalid],
+						message.length() + invalid);
+					result= Result::INVALID;
+				} else {
+					message.append(next, spanLen);
+					next+= spanLen;
+
+					if (block != NULL) {
+						state= State::WAIT_CR;
+						next++;
+					}
+				}
+			}
+			break;
+
+		case State::WAIT_CR:
+			next++;
+			if (c == 0x0D) {
+				state= State::WAIT_SB;
+				lastMessageLen= message.length();
+				result= Result::MESSAGE;
+			} else {
+				Log::log(LOG_ERROR,
+					"Expected CR after EB missing");
+				result= Result::INVALID;
+			}
+			break;
+		}
+	}
+
+	used= next - data;
+
+	return result;
+}
+
+void MllpFramer::next()
+{
+	message.clear();
+	message.reserve(lastMessageLen);
+}
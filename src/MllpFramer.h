@@ -0,0 +1,47 @@
+// Picks MLLP frames - a start block, the message, then an end block and a
+// CR - out of whatever the socket hands over, however it's been split up.
+// Everything up to the end block is checked and taken as one span rather
+// than a byte at a time.
+
+class MllpFramer {
+public:
+	MllpFramer();
+
+	enum class Result {
+		PARTIAL,
+		MESSAGE,
+		INVALID
+	};
+
+	// Frames data until a message is complete, or the data runs out, and
+	// says how much of it was used.
+	Result frame(char const *data, size_t dataLen, size_t &used);
+
+	// Once frame() says there's a message, it's here to be looked at or
+	// moved out.  next() gets ready for the one after.
+	std::string &getMessage() {
+		return message;
+	}
+
+	// When the start block of the message came in
+	uint64_t getReceivedAt() {
+		return receivedAt;
+	}
+
+	void next();
+
+private:
+	enum class State {
+		WAIT_SB,
+		READ_MESSAGE,
+		WAIT_CR
+	};
+
+	State state;
+
+	// Starts each message empty and reserved to the size of the last one
+	std::string message;
+	size_t lastMessageLen;
+
+	uint64_t receivedAt;
+};
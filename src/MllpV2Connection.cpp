@@ -1,18 +1,27 @@
 #include "system.h"
 
+#include "EventLoop.h"
 #include "Connection.h"
 #include "TcpConnection.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+#include "MllpFramer.h"
 #include "MllpConnection.h"
+#include "StringRef.h"
+#include "MshHeader.h"
+#include "Fnv.h"
 #include "MllpV2Connection.h"
 
 #include "Log.h"
 
 MllpV2Connection::MllpV2Connection(
 	ListenerRef listener,
+	EventLoopRef loop,
 	int sock,
 	ServerRef server,
 	char const *remoteHost)
-	: MllpConnection(listener, sock, server, remoteHost)
+	: MllpConnection(listener, loop, sock, server, remoteHost)
 {
 }
 
@@ -20,71 +29,66 @@ MllpV2Connection::~MllpV2Connection()
 {
 }
 
-void MllpV2Connection::split(
-	std::string& line,
-	char separator,
-	std::vector<std::string>& parts)
-{
-	size_t start= 0;
-	for (size_t end= 0;
-		(end= line.find(separator, end)) != std::string::npos;
-		++end)
-	{
-		parts.push_back(line.substr(start, end - start));
-		start= end + 1;
-	}
-	parts.push_back(line.substr(start));
-}
-
-bool MllpV2Connection::parse(char const *message)
+bool MllpV2Connection::parse(char const *message, size_t messageLen)
 {
 	bool accept= false;
-	std::string buffer= message;
 
-	if (buffer.length() < 9) {
+	switch (header.parse(message, messageLen)) {
+	case MshHeader::Result::TOO_SHORT:
 		Log::log(LOG_WARNING, "Message is too short");
-	} else if (buffer.substr(0, 4) != "MSH|") {
+		break;
+
+	case MshHeader::Result::NOT_MSH:
 		Log::log(LOG_WARNING, "Message does not start with MSH header");
-	} else {
-		size_t lineOffset= buffer.find('\r', 0);
-		if (lineOffset <= 0) {
-			Log::log(LOG_WARNING, "Unable to find end of message line");
+		break;
+
+	case MshHeader::Result::TOO_FEW_FIELDS:
+		Log::log(LOG_WARNING, "MSH line contains %d fields we need %d",
+			(int)header.getFieldCount(), (int)MshHeader::FIELDS_NEEDED);
+
+		for (size_t i= 0; i < header.getFieldCount(); i++) {
+			StringRef const &field= header.getField(i);
+
+			Log::log(LOG_DEBUG,
+				"Field %d: %.*s",
+				(int)i, (int)field.getLength(), field.getData());
+		}
+		break;
+
+	case MshHeader::Result::OK:
+		// These are reused from message to message, so once they've grown
+		// to fit there's no more allocation here.
+
+		header.getFromApp().assignTo(fromApp);
+		header.getFromFacility().assignTo(fromFacility);
+		header.getToApp().assignTo(toApp);
+		header.getToFacility().assignTo(toFacility);
+		header.getMessageId().assignTo(messageId);
+
+		if (header.hasEventType()) {
+			header.getEventType().assignTo(eventType);
 		} else {
-			std::string line= buffer.substr(0, lineOffset);
-			char fieldDelim= line.at(3);
-			char componentDelim= line.at(4);
-
-			std::vector<std::string> fields;
-			split(line, fieldDelim, fields);
-
-			if (fields.size() < 12) {
-				Log::log(LOG_WARNING, "MSH line contains %d fields we need 12",
-					fields.size());
-
-				for (size_t i= 0; i < fields.size(); i++) {
-					Log::log(LOG_DEBUG,
-						"Field %d: %s",
-						i, fields.at(i).c_str());
-				}
-			} else {
-				fromApp= fields.at(2);
-				fromFacility= fields.at(3);
-				toApp= fields.at(4);
-				toFacility= fields.at(5);
-				messageId= fields.at(9);
-
-				std::vector<std::string> components;
-				split(fields.at(8), componentDelim, components);
-				if (components.size() >= 2) {
-					eventType= components.at(1);
-				} else {
-					eventType= "R01";
-				}
-
-				accept= true;
-			}
+			eventType= "R01";
 		}
+
+		// MSH-3^MSH-4^MSH-10 names the message as far as the sender is
+		// concerned, so a resend hashes the same
+		if (messageId.empty()) {
+			messageKey= 0;
+		} else {
+			uint64_t key= Fnv::hash64(fromApp.data(), fromApp.length());
+			key= Fnv::hash64("^", 1, key);
+			key= Fnv::hash64(fromFacility.data(), fromFacility.length(), key);
+			key= Fnv::hash64("^", 1, key);
+			key= Fnv::hash64(messageId.data(), messageId.length(), key);
+
+			messageKey= (key == 0) ? 1 : key;
+		}
+
+		accept= true;
+		break;
 	}
+
 	return accept;
 }
 
@@ -4,6 +4,7 @@ class MllpV2Connection
 public:
 	MllpV2Connection(
 		ListenerRef listener,
+		EventLoopRef loop,
 		int sock,
 		ServerRef server,
 		char const *remoteHost);
@@ -11,14 +12,13 @@ public:
 	virtual ~MllpV2Connection();
 
 protected:
-	virtual bool parse(char const *message);
+	virtual bool parse(char const *message, size_t messageLen);
 	virtual void acknowledge(AckType);
 
 private:
 	void sendResponse(bool success);
 
-	void split(std::string& line,
-		char delim, std::vector<std::string>& parts);
+	MshHeader header;
 
 	std::string fromApp;
 	std::string fromFacility;
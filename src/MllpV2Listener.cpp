@@ -3,15 +3,24 @@
 #include "Listener.h"
 #include "MllpV2Listener.h"
 
+#include "EventLoop.h"
 #include "Connection.h"
 #include "TcpConnection.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+#include "MllpFramer.h"
 #include "MllpConnection.h"
+#include "StringRef.h"
+#include "MshHeader.h"
 #include "MllpV2Connection.h"
 
-MllpV2Listener::MllpV2Listener(int family, int port, ServerRef server)
+MllpV2Listener::MllpV2Listener(int family, int port,
+	ServerRef server, EventLoopRef loop)
 	: Listener(family, port)
 {
 	this->server= server;
+	this->loop= loop;
 }
 
 MllpV2Listener::~MllpV2Listener()
@@ -22,6 +31,7 @@ ConnectionRef MllpV2Listener::connect(int sock, char const *remoteHost)
 {
 	return std::make_shared<MllpV2Connection>(
 		shared_from_this(),
+		loop,
 		sock,
 		server,
 		remoteHost);
@@ -4,17 +4,23 @@ typedef std::shared_ptr<Connection> ConnectionRef;
 class Server;
 typedef std::shared_ptr<Server> ServerRef;
 
+class EventLoop;
+typedef std::shared_ptr<EventLoop> EventLoopRef;
+
 class MllpV2Listener : public Listener {
 public:
-	MllpV2Listener(int family, int port, ServerRef server);
+	MllpV2Listener(int family, int port,
+		ServerRef server, EventLoopRef loop);
 	virtual ~MllpV2Listener();
 
 	static ListenerRef Create(
 		int family,
 		int port,
-		ServerRef server)
+		ServerRef server,
+		EventLoopRef loop)
 	{
-		return std::make_shared<MllpV2Listener>(family, port, server);
+		return std::make_shared<MllpV2Listener>(
+			family, port, server, loop);
 	}
 
 protected:
@@ -22,5 +28,6 @@ protected:
 
 private:
 	ServerRef server;
+	EventLoopRef loop;
 };
 
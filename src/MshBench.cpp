@@ -0,0 +1,148 @@
+#include "system.h"
+
+#include "Log.h"
+#include "StringRef.h"
+#include "MshHeader.h"
+
+// Times MshHeader picking the acknowledgement fields out of the MSH
+// segment in place, filling the same reused strings the connection keeps.
+// The fields are checked against what's in the message before anything is
+// timed.
+
+// Messages parsed between looks at the clock
+#define BATCH 1000
+
+struct Fields {
+	std::string fromApp;
+	std::string fromFacility;
+	std::string toApp;
+	std::string toFacility;
+	std::string eventType;
+	std::string messageId;
+};
+
+static bool parseInPlace(MshHeader &header,
+	char const *message, size_t messageLen, Fields &fields)
+{
+	if (header.parse(message, messageLen) != MshHeader::Result::OK) {
+		return false;
+	}
+
+	header.getFromApp().assignTo(fields.fromApp);
+	header.getFromFacility().assignTo(fields.fromFacility);
+	header.getToApp().assignTo(fields.toApp);
+	header.getToFacility().assignTo(fields.toFacility);
+	header.getMessageId().assignTo(fields.messageId);
+
+	if (header.hasEventType()) {
+		header.getEventType().assignTo(fields.eventType);
+	} else {
+		fields.eventType= "R01";
+	}
+
+	return true;
+}
+
+static uint64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs parse over and over for at least duration nanoseconds, and returns
+// the nanoseconds each one took
+template<typename Parse>
+static double timeParse(Parse parse, uint64_t duration)
+{
+	long count= 0;
+
+	uint64_t started= now();
+	uint64_t elapsed;
+
+	do {
+		for (int i= 0; i < BATCH; i++) {
+			if (!parse()) {
+				return 0;
+			}
+		}
+		count+= BATCH;
+
+		elapsed= now() - started;
+	} while (elapsed < duration);
+
+	return (double)elapsed / count;
+}
+
+static bool measure(char const *name, std::string const &message,
+	char const *messageId, char const *eventType, uint64_t duration)
+{
+	MshHeader header;
+	Fields fields;
+
+	if (!parseInPlace(header, message.data(), message.length(), fields)) {
+		Log::log(LOG_ERROR, "%s didn't parse", name);
+		return false;
+	}
+	if ((fields.messageId != messageId) || (fields.eventType != eventType)) {
+		Log::log(LOG_ERROR, "%s parsed wrongly", name);
+		return false;
+	}
+
+	double inPlaceTime= timeParse([&]() {
+		return parseInPlace(header, message.data(), message.length(), fields);
+	}, duration);
+
+	printf("%s (%zu bytes): %10.1f ns/msg\n",
+		name, message.length(), inPlaceTime);
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	Log::start();
+
+	// Seconds spent on each run
+	int seconds= 1;
+
+	int c;
+	while ((c= getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			seconds= atoi(optarg);
+			if (seconds < 1) {
+				Log::log(LOG_ERROR,
+					"Duration is invalid");
+				exit(1);
+			}
+			break;
+
+		default:
+			fprintf(stderr, "Unknown argument %c\n", optopt);
+			exit(1);
+		}
+	}
+
+	uint64_t duration= (uint64_t)seconds * 1000000000;
+
+	std::string adt=
+		"MSH|^~\\&|REGADT|MCM|IFENG|RECV|20260101120000||ADT^A01|CTL0001|"
+		"P|2.4\r"
+		"EVN|A01|20260101120000\r"
+		"PID|||191919^^^GENHOS^MR||MASSIE^JAMES^A||19560129|M\r";
+	while (adt.length() < 1024) {
+		adt.append("NTE|1||ROUTINE ADMISSION NOTE\r");
+	}
+
+	std::string oru=
+		"MSH|^~\\&|LAB|MCM|IFENG|RECV|20260101120000||ORU^R01^ORU_R01|"
+		"CTL0002|P|2.5\r"
+		"OBX|1|ED|PDF^Report||^application^pdf^Base64^";
+	oru.append(200 * 1024, 'A');
+	oru.append("||||||F\r");
+
+	bool clean= measure("ADT^A01", adt, "CTL0001", "A01", duration) &&
+		measure("ORU^R01", oru, "CTL0002", "R01", duration);
+
+	return clean ? 0 : 1;
+}
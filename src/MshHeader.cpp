@@ -0,0 +1,76 @@
+#include "system.h"
+
+#include "StringRef.h"
+#include "MshHeader.h"
+
+MshHeader::MshHeader()
+{
+	fieldCount= 0;
+	eventTypeFound= false;
+}
+
+MshHeader::~MshHeader()
+{
+}
+
+MshHeader::Result MshHeader::parse(char const *message, size_t messageLen)
+{
+	fieldCount= 0;
+	eventTypeFound= false;
+	eventType= StringRef();
+
+	if (messageLen < 9) {
+		return Result::TOO_SHORT;
+	}
+	if (memcmp(message, "MSH", 3) != 0) {
+		return Result::NOT_MSH;
+	}
+
+	// MSH-1 is the field separator itself, and MSH-2 starts with the
+	// component separator.
+	char fieldDelim= message[3];
+	char componentDelim= message[4];
+
+	char const *lineEnd= static_cast<char const *>(
+		memchr(message, '\r', messageLen));
+	if (lineEnd == NULL) {
+		lineEnd= message + messageLen;
+	}
+
+	char const *start= message;
+	for (bool run= true; run && (fieldCount < FIELDS_NEEDED); ) {
+		char const *delim= static_cast<char const *>(
+			memchr(start, fieldDelim, lineEnd - start));
+
+		char const *end= (delim != NULL) ? delim : lineEnd;
+		fields[fieldCount++]= StringRef(start, end - start);
+
+		if (delim != NULL) {
+			start= delim + 1;
+		} else {
+			run= false;
+		}
+	}
+
+	if (fieldCount < FIELDS_NEEDED) {
+		return Result::TOO_FEW_FIELDS;
+	}
+
+	StringRef const &messageType= fields[8];
+	char const *typeEnd= messageType.getData() + messageType.getLength();
+	char const *componentStart= messageType.find(componentDelim);
+	if (componentStart != NULL) {
+		componentStart++;
+
+		char const *componentEnd= static_cast<char const *>(
+			memchr(componentStart, componentDelim, typeEnd - componentStart));
+		if (componentEnd == NULL) {
+			componentEnd= typeEnd;
+		}
+
+		eventType= StringRef(componentStart, componentEnd - componentStart);
+		eventTypeFound= true;
+	}
+
+	return Result::OK;
+}
@@ -0,0 +1,60 @@
+// Picks the fields we need for an acknowledgement out of the MSH segment
+// in place, using the field and component separators the message declares.
+// Nothing is copied - the results point into the message buffer.
+
+class MshHeader {
+public:
+	MshHeader();
+	virtual ~MshHeader();
+
+	enum class Result {
+		OK,
+		TOO_SHORT,
+		NOT_MSH,
+		TOO_FEW_FIELDS
+	};
+
+	// Fields needed to get out to MSH-12
+	static const size_t FIELDS_NEEDED= 12;
+
+	Result parse(char const *message, size_t messageLen);
+
+	StringRef const &getFromApp() const {
+		return fields[2];
+	}
+	StringRef const &getFromFacility() const {
+		return fields[3];
+	}
+	StringRef const &getToApp() const {
+		return fields[4];
+	}
+	StringRef const &getToFacility() const {
+		return fields[5];
+	}
+	StringRef const &getMessageId() const {
+		return fields[9];
+	}
+
+	// Second component of MSH-9, if MSH-9 has more than one component
+	bool hasEventType() const {
+		return eventTypeFound;
+	}
+	StringRef const &getEventType() const {
+		return eventType;
+	}
+
+	// Only the first FIELDS_NEEDED are kept
+	size_t getFieldCount() const {
+		return fieldCount;
+	}
+	StringRef const &getField(size_t index) const {
+		return fields[index];
+	}
+
+private:
+	StringRef fields[FIELDS_NEEDED];
+	size_t fieldCount;
+
+	bool eventTypeFound;
+	StringRef eventType;
+};
@@ -0,0 +1,73 @@
+#include "system.h"
+
+#include "Log.h"
+#include "Fnv.h"
+#include "Message.h"
+#include "Server.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+#include "PoolServer.h"
+
+PoolServer::PoolServer(std::vector<ServerRef> const &workers)
+{
+	this->workers= workers;
+
+	assert(!this->workers.empty());
+}
+
+PoolServer::~PoolServer()
+{
+}
+
+ServerRef PoolServer::pick(MessageRef message)
+{
+	uint32_t hash= Fnv::hash(
+		message->getRemoteHost(), strlen(message->getRemoteHost()));
+
+	return workers[hash % workers.size()];
+}
+
+bool PoolServer::queue(MessageRef message)
+{
+	return pick(message)->queue(message);
+}
+
+FrameRef PoolServer::submit(MessageRef message,
+	std::function<void(bool success)> done)
+{
+	return pick(message)->submit(message, done);
+}
+
+bool PoolServer::start()
+{
+	bool success= true;
+
+	size_t started= 0;
+	while (success && (started < workers.size())) {
+		if (workers[started]->start()) {
+			started++;
+		} else {
+			success= false;
+		}
+	}
+
+	if (success) {
+		Log::log(LOG_INFO,
+			"Started %d broker connections", (int)workers.size());
+	} else {
+		// Don't leave the ones that did start running behind us
+		while (started > 0) {
+			workers[--started]->stop();
+		}
+	}
+
+	return success;
+}
+
+void PoolServer::stop()
+{
+	for (ServerRef worker : workers) {
+		worker->stop();
+	}
+}
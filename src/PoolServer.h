@@ -0,0 +1,34 @@
+class Message;
+typedef std::shared_ptr<Message> MessageRef;
+
+class Server;
+typedef std::shared_ptr<Server> ServerRef;
+
+// Spreads messages across several upstream servers, each with its own
+// broker connection.  Messages are assigned by a hash of where they came
+// from, so everything from one sender goes through the same worker and
+// stays in order.
+
+class PoolServer : public Server {
+public:
+	PoolServer(std::vector<ServerRef> const &workers);
+
+	static ServerRef Create(std::vector<ServerRef> const &workers)
+	{
+		return std::make_shared<PoolServer>(workers);
+	}
+
+	virtual ~PoolServer();
+
+	virtual bool queue(MessageRef) override;
+	virtual FrameRef submit(MessageRef,
+		std::function<void(bool success)> done= nullptr) override;
+
+	virtual bool start() override;
+	virtual void stop() override;
+
+private:
+	std::vector<ServerRef> workers;
+
+	ServerRef pick(MessageRef);
+};
@@ -0,0 +1,261 @@
+#include "system.h"
+
+#include "Log.h"
+#include "Message.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
+
+// Has a crowd of threads hand frames to one consumer and wait for each
+// answer, the way connection threads do with the broker sender.  The old
+// way is a list behind a mutex and condition variable, with a new frame
+// holding its own mutex and condition variable for every message.  The new
+// way is AmqServer's: a RingQueue the sender sleeps on through a Signal,
+// and pooled Frames answered through a futex.
+//
+// The old frame here waits on a flag rather than on the notify alone, so
+// it doesn't lose wakeups the way the original did and stall for the
+// whole timeout.
+
+#define QUEUE_LIMIT 8192
+
+// Seconds a producer waits on an answer
+#define AWAIT_TIMEOUT 10
+
+class LockedFrame {
+public:
+	LockedFrame(MessageRef message)
+	{
+		this->message= message;
+		done= false;
+		success= false;
+	}
+
+	bool await(int timeout)
+	{
+		std::unique_lock<std::mutex> permit(completeLock);
+		completeWake.wait_for(permit, std::chrono::seconds(timeout),
+			[this]() { return done; });
+
+		return success;
+	}
+
+	void complete(bool success)
+	{
+		std::lock_guard<std::mutex> permit(completeLock);
+		this->success= success;
+		done= true;
+		completeWake.notify_one();
+	}
+
+private:
+	MessageRef message;
+
+	std::mutex completeLock;
+	std::condition_variable completeWake;
+
+	bool done;
+	bool success;
+};
+
+typedef std::shared_ptr<LockedFrame> LockedFrameRef;
+
+class LockedQueue {
+public:
+	LockedQueue()
+	{
+		run= true;
+	}
+
+	bool queue(MessageRef message)
+	{
+		LockedFrameRef frame= std::make_shared<LockedFrame>(message);
+
+		{
+			std::lock_guard<std::mutex> permit(lock);
+			frames.push_back(frame);
+		}
+		wake.notify_one();
+
+		return frame->await(AWAIT_TIMEOUT);
+	}
+
+	void consume()
+	{
+		std::unique_lock<std::mutex> permit(lock);
+		while (run || !frames.empty()) {
+			if (frames.empty()) {
+				wake.wait(permit);
+			} else {
+				LockedFrameRef frame= frames.front();
+				frames.pop_front();
+
+				permit.unlock();
+				frame->complete(true);
+				permit.lock();
+			}
+		}
+	}
+
+	void stop()
+	{
+		std::lock_guard<std::mutex> permit(lock);
+		run= false;
+		wake.notify_one();
+	}
+
+private:
+	std::list<LockedFrameRef> frames;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool run;
+};
+
+class RingFrameQueue {
+public:
+	RingFrameQueue()
+		: frames(QUEUE_LIMIT)
+	{
+		run= true;
+	}
+
+	bool queue(MessageRef message)
+	{
+		FrameRef frame= Frame::Create(message);
+
+		if (!frames.push(frame)) {
+			return false;
+		}
+		signal.notify();
+
+		return frame->await(AWAIT_TIMEOUT);
+	}
+
+	void consume()
+	{
+		for (;;) {
+			FrameRef frame;
+			if (!frames.pop(frame)) {
+				int key= signal.prepare();
+				if (run && !frames.pop(frame)) {
+					signal.wait(key, -1);
+				}
+				signal.finish();
+			}
+
+			if (frame) {
+				frame->complete(true);
+			} else if (!run) {
+				break;
+			}
+		}
+	}
+
+	void stop()
+	{
+		run= false;
+		signal.notify();
+	}
+
+private:
+	RingQueue<FrameRef> frames;
+	Signal signal;
+	std::atomic<bool> run;
+};
+
+static uint64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns the frames answered per second, or 0 if any went unanswered
+template<typename Queue>
+static double run(int producers, long count)
+{
+	Queue queue;
+	std::atomic<long> failed(0);
+
+	std::thread consumer(&Queue::consume, &queue);
+
+	std::vector<std::thread> threads;
+
+	uint64_t started= now();
+
+	for (int i= 0; i < producers; i++) {
+		threads.emplace_back([&]() {
+			// One message each is plenty - it's the frames being measured
+			MessageRef message= Message::Create(
+				time(NULL), "127.0.0.1", std::string("MSH|^~\\&|\r"), 0);
+
+			for (long n= 0; n < count; n++) {
+				if (!queue.queue(message)) {
+					failed++;
+				}
+			}
+		});
+	}
+
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	double elapsed= std::max(now() - started, (uint64_t)1) / 1e6;
+
+	queue.stop();
+	consumer.join();
+
+	if (failed > 0) {
+		Log::log(LOG_ERROR,
+			"%ld frames weren't answered", failed.load());
+		return 0;
+	}
+
+	return producers * count / elapsed;
+}
+
+int main(int argc, char* argv[])
+{
+	Log::start();
+
+	int producers= 64;
+
+	// Frames each producer sends
+	long count= 5000;
+
+	int c;
+	while ((c= getopt(argc, argv, "c:n:")) != -1) {
+		switch (c) {
+		case 'c':
+			producers= atoi(optarg);
+			if (producers < 1) {
+				Log::log(LOG_ERROR,
+					"Producer count is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'n':
+			count= atol(optarg);
+			if (count < 1) {
+				Log::log(LOG_ERROR,
+					"Frame count is invalid");
+				exit(1);
+			}
+			break;
+
+		default:
+			fprintf(stderr, "Unknown argument %c\n", optopt);
+			exit(1);
+		}
+	}
+
+	double before= run<LockedQueue>(producers, count);
+	double after= run<RingFrameQueue>(producers, count);
+
+	printf("%d producers, %ld frames each:\n", producers, count);
+	printf("  locked list:   %10.1f frames/s\n", before);
+	printf("  ring and pool: %10.1f frames/s\n", after);
+
+	return ((before == 0) || (after == 0)) ? 1 : 0;
+}
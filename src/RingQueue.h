@@ -0,0 +1,110 @@
+// Bounded lock-free queue on a ring of sequenced cells (Vyukov's design).
+// Any number of threads can push and pop at once, and nobody ever takes a
+// lock or waits on another thread - a push into a full ring or a pop from
+// an empty one just fails.  Capacity is rounded up to a power of two.
+
+template<typename T>
+class RingQueue {
+public:
+	RingQueue(size_t capacity)
+	{
+		size_t size= 2;
+		while (size < capacity) {
+			size<<= 1;
+		}
+
+		mask= size - 1;
+		cells.reset(new Cell[size]);
+
+		for (size_t i= 0; i < size; i++) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		enqueuePos.store(0, std::memory_order_relaxed);
+		dequeuePos.store(0, std::memory_order_relaxed);
+	}
+
+	bool push(T value)
+	{
+		Cell *cell;
+
+		size_t pos= enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell= &cells[pos & mask];
+
+			size_t sequence= cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff= (intptr_t)sequence - (intptr_t)pos;
+
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(
+					pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos= enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data= std::move(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	bool pop(T &value)
+	{
+		Cell *cell;
+
+		size_t pos= dequeuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell= &cells[pos & mask];
+
+			size_t sequence= cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff= (intptr_t)sequence - (intptr_t)(pos + 1);
+
+			if (diff == 0) {
+				if (dequeuePos.compare_exchange_weak(
+					pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos= dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		value= std::move(cell->data);
+		cell->data= T();
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Only a snapshot, since other threads can be pushing and popping
+	size_t size() const
+	{
+		size_t enqueued= enqueuePos.load(std::memory_order_relaxed);
+		size_t dequeued= dequeuePos.load(std::memory_order_relaxed);
+
+		return (enqueued > dequeued) ? (enqueued - dequeued) : 0;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+
+	// Kept on separate cache lines so producers and consumers don't
+	// fight over them
+	alignas(64) std::atomic<size_t> enqueuePos;
+	alignas(64) std::atomic<size_t> dequeuePos;
+};
@@ -0,0 +1,1111 @@
+#include "system.h"
+
+#include "Log.h"
+#include "Crc32.h"
+#include "Fnv.h"
+#include "Message.h"
+#include "Metrics.h"
+#include "SegmentLog.h"
+
+// Segment files are named by their number, which only ever goes up, so a
+// directory listing sorted by name is also in the order they were written.
+#define SEGMENT_SUFFIX ".seg"
+#define SEGMENT_MAGIC "MLLPSEG1"
+#define SEGMENT_HEADER_SIZE 64
+
+// Fully delivered segments kept around to be reused instead of allocating
+// new ones.
+#define SPARE_SEGMENTS 2
+
+#define RECORD_ALIGN 8
+
+// Threads indexing segments at startup
+#define RECOVERY_THREADS 4
+
+#define RECORD_EMPTY 0
+#define RECORD_LIVE 1
+#define RECORD_DELIVERED 2
+#define RECORD_QUARANTINED 3
+
+static Histogram syncLatency("mllp_log_sync_seconds", "",
+	"Time to sync a group of appends to the local queue");
+
+struct SegmentHeader {
+	char magic[8];
+	uint64_t number;
+	uint32_t headerCrc;
+	uint32_t reserved;
+};
+
+// The state word is left out of the header checksum so it can be
+// rewritten in place.  The checksum is seeded with the segment number, so
+// records left over from a recycled segment's previous life never pass.
+// The body checksum covers the remote host and the message body, which
+// follow the header.
+
+struct RecordHeader {
+	uint32_t state;
+	uint32_t headerCrc;
+	uint64_t sequence;
+	int64_t timestamp;
+	uint32_t bodyLen;
+	uint32_t bodyCrc;
+	uint16_t hostLen;
+	uint16_t reserved1;
+	uint32_t reserved2;
+};
+
+#define RECORD_CHECKED_OFFSET offsetof(RecordHeader, sequence)
+
+static uint32_t headerCrc(uint64_t segment, RecordHeader const &header)
+{
+	uint32_t crc= Crc32::update(0, &segment, sizeof(segment));
+
+	return Crc32::update(crc,
+		reinterpret_cast<char const *>(&header) + RECORD_CHECKED_OFFSET,
+		sizeof(header) - RECORD_CHECKED_OFFSET);
+}
+
+static uint32_t recordLength(size_t hostLen, size_t bodyLen)
+{
+	size_t length= sizeof(RecordHeader) + hostLen + bodyLen;
+
+	return (length + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+SegmentLog::SegmentLog(char const *basePath, size_t segmentSize,
+	int commitDelay, uint64_t diskQuota, int highWater)
+{
+	this->basePath= basePath;
+	this->segmentSize= segmentSize;
+	this->commitDelay= commitDelay;
+	this->diskQuota= diskQuota;
+	this->highWater= highWater;
+
+	full= false;
+
+	committer= NULL;
+	committing= false;
+
+	recoverer= NULL;
+	recoveryCancelled= false;
+
+	dirFd= -1;
+	active= NULL;
+	prepared= NULL;
+	preparing= false;
+
+	nextSegment= 1;
+	nextSequence= 1;
+}
+
+SegmentLog::~SegmentLog()
+{
+	close();
+}
+
+std::string SegmentLog::segmentPath(uint64_t number)
+{
+	char name[32];
+	sprintf(name, "%016llx" SEGMENT_SUFFIX, (unsigned long long)number);
+
+	std::string path= basePath;
+	path.append(1, '/');
+	path.append(name);
+
+	return path;
+}
+
+bool SegmentLog::open(RecoverFunction recovered, FinishFunction finished)
+{
+	dirFd= ::open(basePath.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dirFd == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to open queue directory %s: %s",
+			basePath.c_str(), strerror(errno));
+
+		return false;
+	}
+
+	std::list<uint64_t> numbers;
+
+	DIR *dir= opendir(basePath.c_str());
+	if (dir == NULL) {
+		Log::log(LOG_ERROR,
+			"Unable to scan queue directory %s: %s",
+			basePath.c_str(), strerror(errno));
+
+		::close(dirFd);
+		dirFd= -1;
+
+		return false;
+	}
+
+	struct dirent *de= NULL;
+	while ((de= readdir(dir)) != NULL) {
+		char *end= NULL;
+		unsigned long long number= strtoull(de->d_name, &end, 16);
+
+		if ((end == de->d_name + 16) && (strcmp(end, SEGMENT_SUFFIX) == 0)) {
+			numbers.push_back(number);
+		}
+	}
+	closedir(dir);
+
+	numbers.sort();
+
+	std::lock_guard<std::mutex> permit(lock);
+
+	std::vector<Segment *> pending;
+
+	for (uint64_t number : numbers) {
+		std::string path= segmentPath(number);
+
+		int fd= ::open(path.c_str(), O_RDWR|O_CLOEXEC);
+		if (fd == -1) {
+			Log::log(LOG_ERROR,
+				"Unable to open segment %s: %s",
+				path.c_str(), strerror(errno));
+			continue;
+		}
+
+		Segment *segment= new Segment();
+		segment->number= number;
+		segment->fd= fd;
+		segment->size= SEGMENT_HEADER_SIZE;
+		segment->live= 0;
+		segment->dirty= false;
+
+		if (number >= nextSegment) {
+			nextSegment= number + 1;
+		}
+
+		segments[number]= segment;
+
+		// A segment whose header doesn't match its name was being recycled
+		// when we went down, so there's nothing in it worth keeping.
+
+		SegmentHeader header;
+		if ((pread(fd, &header, sizeof(header), 0) == sizeof(header)) &&
+			(memcmp(header.magic, SEGMENT_MAGIC, sizeof(header.magic)) == 0) &&
+			(header.number == number) &&
+			(header.headerCrc == Crc32::update(0, &header,
+				offsetof(SegmentHeader, headerCrc))))
+		{
+			pending.push_back(segment);
+		} else {
+			Log::log(LOG_WARNING,
+				"Segment %s has no valid header, reusing it",
+				path.c_str());
+
+			retire(segment);
+		}
+	}
+
+	// Sequence numbers carry on from the newest record, which is in the
+	// last segment that has any at all.
+
+	for (auto it= pending.rbegin(); it != pending.rend(); ++it) {
+		uint64_t lastSequence= 0;
+		scanSegment(*it, NULL, lastSequence, (*it)->size);
+
+		if (lastSequence != 0) {
+			nextSequence= lastSequence + 1;
+			break;
+		}
+	}
+
+	// New records always go into a fresh segment, never after whatever
+	// was at the end of the last one.  Nothing else is running yet, so
+	// it's fine to set it up under the lock.
+
+	Segment *spare= NULL;
+	if (!spares.empty()) {
+		spare= spares.front();
+		spares.pop_front();
+	}
+
+	uint64_t number= nextSegment++;
+	active= setupSegment(spare, number);
+	if (active == NULL) {
+		return false;
+	}
+	segments[number]= active;
+
+	committing= true;
+	committer= new std::thread(&SegmentLog::commitLoop, this);
+
+	// Everything else is indexed in the background, so new messages can
+	// be taken and the backlog forwarded while it's still going.
+
+	recoveryCancelled= false;
+	recoverer= new std::thread(&SegmentLog::recoverLoop, this,
+		pending, recovered, finished);
+
+	return true;
+}
+
+void SegmentLog::scanSegment(Segment *segment,
+	std::vector<Location> *live, uint64_t &lastSequence, uint64_t &size)
+{
+	// Only the record headers are checked here.  Bodies are checked when
+	// they're read back to be sent.  The size where the records end goes
+	// back to the caller, since it's read under the lock.
+
+	struct stat info;
+	if (fstat(segment->fd, &info) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to stat segment %llu: %s",
+			(unsigned long long)segment->number, strerror(errno));
+		return;
+	}
+
+	size_t fileSize= info.st_size;
+	if (fileSize <= SEGMENT_HEADER_SIZE) {
+		size= SEGMENT_HEADER_SIZE;
+		return;
+	}
+
+	void *map= mmap(NULL, fileSize, PROT_READ, MAP_SHARED, segment->fd, 0);
+	if (map == MAP_FAILED) {
+		Log::log(LOG_ERROR,
+			"Unable to map segment %llu: %s",
+			(unsigned long long)segment->number, strerror(errno));
+		return;
+	}
+
+	char const *base= static_cast<char const *>(map);
+
+	uint64_t offset= SEGMENT_HEADER_SIZE;
+	while (offset + sizeof(RecordHeader) <= fileSize) {
+		RecordHeader header;
+		memcpy(&header, base + offset, sizeof(header));
+
+		if ((header.state == RECORD_EMPTY) ||
+			(header.headerCrc != headerCrc(segment->number, header)))
+		{
+			break;
+		}
+
+		uint32_t length= recordLength(header.hostLen, header.bodyLen);
+		if (offset + length > fileSize) {
+			break;
+		}
+
+		if ((live != NULL) && (header.state == RECORD_LIVE)) {
+			Location location;
+			location.segment= segment->number;
+			location.offset= offset;
+			location.sequence= header.sequence;
+			location.length= length;
+			location.timestamp= header.timestamp;
+			location.hostHash= Fnv::hash(
+				base + offset + sizeof(header), header.hostLen);
+
+			live->push_back(location);
+		}
+
+		lastSequence= header.sequence;
+		offset+= length;
+	}
+
+	munmap(map, fileSize);
+
+	size= offset;
+}
+
+void SegmentLog::recoverLoop(std::vector<Segment *> pending,
+	RecoverFunction recovered, FinishFunction finished)
+{
+	// Segments are scanned by a few threads at once, but handed on strictly
+	// in order - each as soon as it and everything before it is done.
+
+	struct Scan {
+		std::vector<Location> live;
+		uint64_t size;
+		bool done;
+	};
+
+	std::vector<Scan> scans(pending.size());
+	std::atomic<size_t> nextScan(0);
+	std::mutex scanLock;
+	std::condition_variable scanWake;
+
+	auto scanner= [&]() {
+		for (size_t i; (i= nextScan++) < pending.size(); ) {
+			if (!recoveryCancelled) {
+				uint64_t lastSequence= 0;
+				scanSegment(pending[i], &scans[i].live, lastSequence,
+					scans[i].size);
+			}
+
+			std::lock_guard<std::mutex> permit(scanLock);
+			scans[i].done= true;
+			scanWake.notify_all();
+		}
+	};
+
+	size_t threadCount= std::min(pending.size(), (size_t)RECOVERY_THREADS);
+
+	std::vector<std::thread *> threads;
+	for (size_t i= 0; i < threadCount; i++) {
+		threads.push_back(new std::thread(scanner));
+	}
+
+	size_t recordCount= 0;
+
+	for (size_t i= 0; i < pending.size(); i++) {
+		{
+			std::unique_lock<std::mutex> permit(scanLock);
+			scanWake.wait(permit, [&scans, i] { return scans[i].done; });
+		}
+
+		if (recoveryCancelled) {
+			continue;
+		}
+
+		// The live count has to be complete before any record is handed
+		// on, or a quick delivery could retire the segment under us.
+
+		{
+			std::lock_guard<std::mutex> permit(lock);
+
+			pending[i]->size= scans[i].size;
+			pending[i]->live= scans[i].live.size();
+			if (pending[i]->live == 0) {
+				retire(pending[i]);
+			}
+		}
+
+		for (Location const &location : scans[i].live) {
+			recovered(location);
+		}
+
+		recordCount+= scans[i].live.size();
+		std::vector<Location>().swap(scans[i].live);
+	}
+
+	for (std::thread *thread : threads) {
+		thread->join();
+		delete thread;
+	}
+
+	if (!pending.empty()) {
+		Log::log(LOG_INFO,
+			"Recovered %d records from %d segments in %s",
+			(int)recordCount, (int)pending.size(), basePath.c_str());
+	}
+
+	finished();
+}
+
+bool SegmentLog::readRecord(Segment *segment, uint64_t offset,
+	Location &location, uint32_t &state, MessageRef *message)
+{
+	RecordHeader header;
+	if (pread(segment->fd, &header, sizeof(header), offset) !=
+		sizeof(header))
+	{
+		return false;
+	}
+
+	// An empty state word is the unwritten end of the segment, and a bad
+	// header checksum is a torn write or a leftover from the segment's
+	// previous life.  Either way it's the end of the records.
+
+	if ((header.state == RECORD_EMPTY) ||
+		(header.headerCrc != headerCrc(segment->number, header)))
+	{
+		return false;
+	}
+
+	state= header.state;
+
+	location.segment= segment->number;
+	location.offset= offset;
+	location.sequence= header.sequence;
+	location.length= recordLength(header.hostLen, header.bodyLen);
+	location.timestamp= header.timestamp;
+	location.hostHash= 0;
+
+	// Delivered records don't need their bodies read back
+
+	if ((message == NULL) || (state != RECORD_LIVE)) {
+		return true;
+	}
+
+	std::string host(header.hostLen, '\0');
+	std::string body(header.bodyLen, '\0');
+
+	struct iovec parts[2];
+	parts[0].iov_base= &host[0];
+	parts[0].iov_len= header.hostLen;
+	parts[1].iov_base= &body[0];
+	parts[1].iov_len= header.bodyLen;
+
+	// With a good header the length can be trusted, so a damaged body
+	// only costs this one record - the caller gets no message back and
+	// can carry on with the next.
+
+	ssize_t expected= header.hostLen + header.bodyLen;
+	if (preadv(segment->fd, parts, 2, offset + sizeof(header)) != expected) {
+		Log::log(LOG_ERROR,
+			"Short read on record %llu in segment %llu",
+			(unsigned long long)header.sequence,
+			(unsigned long long)segment->number);
+
+		return true;
+	}
+
+	uint32_t crc= Crc32::update(0, host.data(), host.length());
+	crc= Crc32::update(crc, body.data(), body.length());
+
+	if (crc != header.bodyCrc) {
+		Log::log(LOG_ERROR,
+			"Checksum mismatch on record %llu in segment %llu",
+			(unsigned long long)header.sequence,
+			(unsigned long long)segment->number);
+	} else {
+		*message= Message::Create(
+			(time_t)header.timestamp, host.c_str(), std::move(body), 0);
+	}
+
+	return true;
+}
+
+bool SegmentLog::writeHeader(Segment *segment)
+{
+	bool success= false;
+
+	char buffer[SEGMENT_HEADER_SIZE];
+	memset(buffer, 0, sizeof(buffer));
+
+	SegmentHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+	header.number= segment->number;
+	header.headerCrc= Crc32::update(0, &header,
+		offsetof(SegmentHeader, headerCrc));
+
+	memcpy(buffer, &header, sizeof(header));
+
+	if (pwrite(segment->fd, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+		Log::log(LOG_ERROR,
+			"Unable to write header for segment %llu: %s",
+			(unsigned long long)segment->number, strerror(errno));
+	} else if (fdatasync(segment->fd) == -1) {
+		Log::log(LOG_ERROR,
+			"Error in fdatasync on segment %llu: %s",
+			(unsigned long long)segment->number, strerror(errno));
+	} else {
+		success= true;
+	}
+
+	return success;
+}
+
+bool SegmentLog::roomForSegment()
+{
+	// Called with the lock held.  Recycling a spare takes no more space,
+	// so the limits only matter once there are none.
+
+	bool room= true;
+
+	if (spares.empty() && (diskQuota > 0)) {
+		uint64_t used= 0;
+		for (auto const &entry : segments) {
+			used+= std::max(entry.second->size, (uint64_t)segmentSize);
+		}
+		if (prepared != NULL) {
+			used+= segmentSize;
+		}
+
+		if (used + segmentSize > diskQuota) {
+			room= false;
+		}
+	}
+
+	if (room && spares.empty() && (highWater > 0)) {
+		struct statvfs info;
+		if ((fstatvfs(dirFd, &info) == 0) && (info.f_blocks > 0)) {
+			uint64_t total= (uint64_t)info.f_blocks * info.f_frsize;
+			uint64_t used= (uint64_t)(info.f_blocks - info.f_bfree) *
+				info.f_frsize;
+			uint64_t available= (uint64_t)info.f_bavail * info.f_frsize;
+
+			if ((available < segmentSize) ||
+				((used + segmentSize) * 100 > total * highWater))
+			{
+				room= false;
+			}
+		}
+	}
+
+	// Only say so when it changes - while full this is hit for every new
+	// message.
+
+	if (!room && !full) {
+		Log::log(LOG_WARNING,
+			"Queue in %s is full - refusing new messages until the "
+			"backlog drains", basePath.c_str());
+	} else if (room && full) {
+		Log::log(LOG_INFO,
+			"Queue in %s has room again", basePath.c_str());
+	}
+
+	full= !room;
+
+	return room;
+}
+
+SegmentLog::Segment *SegmentLog::setupSegment(Segment *spare, uint64_t number)
+{
+	// Renames the spare, or creates a new file if there isn't one, and
+	// writes and syncs its header.  Hands back NULL if it can't.
+
+	std::string path= segmentPath(number);
+
+	Segment *segment= spare;
+
+	if (segment != NULL) {
+		std::string oldPath= segmentPath(segment->number);
+		if (rename(oldPath.c_str(), path.c_str()) == -1) {
+			Log::log(LOG_ERROR,
+				"Unable to recycle segment %s as %s: %s",
+				oldPath.c_str(), path.c_str(), strerror(errno));
+
+			::close(segment->fd);
+			delete segment;
+			segment= NULL;
+		}
+	}
+
+	if (segment == NULL) {
+		int fd= ::open(path.c_str(),
+			O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC,
+			S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+
+		if (fd == -1) {
+			Log::log(LOG_ERROR,
+				"Unable to create segment %s: %s",
+				path.c_str(), strerror(errno));
+
+			return NULL;
+		}
+
+		// posix_fallocate hands back the error instead of setting errno
+		int error= posix_fallocate(fd, 0, segmentSize);
+		if (error != 0) {
+			Log::log(LOG_ERROR,
+				"Unable to allocate segment %s: %s",
+				path.c_str(), strerror(error));
+
+			::close(fd);
+			unlink(path.c_str());
+
+			return NULL;
+		}
+
+		segment= new Segment();
+		segment->fd= fd;
+	}
+
+	segment->number= number;
+	segment->size= SEGMENT_HEADER_SIZE;
+	segment->live= 0;
+	segment->dirty= false;
+
+	if (!writeHeader(segment)) {
+		::close(segment->fd);
+		unlink(path.c_str());
+		delete segment;
+
+		return NULL;
+	}
+
+	// Make the new name itself durable
+	if (fsync(dirFd) == -1) {
+		Log::log(LOG_ERROR,
+			"Error in fsync on queue directory %s: %s",
+			basePath.c_str(), strerror(errno));
+	}
+
+	return segment;
+}
+
+bool SegmentLog::prepareSegment()
+{
+	// Called without the lock.  Gets the next segment ready ahead of time,
+	// so the syncs that takes don't hold up appends - rotating then only
+	// has to swap it in.  False if there's no room for one, or it couldn't
+	// be set up.
+
+	Segment *spare= NULL;
+	uint64_t number;
+	{
+		std::lock_guard<std::mutex> permit(lock);
+
+		// Somebody else got there first
+		if ((prepared != NULL) || preparing) {
+			return true;
+		}
+
+		if (!roomForSegment()) {
+			return false;
+		}
+
+		if (!spares.empty()) {
+			spare= spares.front();
+			spares.pop_front();
+		}
+
+		number= nextSegment++;
+		preparing= true;
+	}
+
+	Segment *segment= setupSegment(spare, number);
+
+	std::lock_guard<std::mutex> permit(lock);
+
+	prepared= segment;
+	preparing= false;
+	preparedWake.notify_all();
+
+	return segment != NULL;
+}
+
+bool SegmentLog::rotate(std::unique_lock<std::mutex> &permit)
+{
+	// Called with the lock held.  If there's no segment ready it's let go
+	// while one is set up, so the caller has to check again whether it
+	// still needs to rotate once this returns.
+
+	if (prepared == NULL) {
+		if (preparing) {
+			preparedWake.wait(permit);
+			return true;
+		}
+
+		permit.unlock();
+		bool ready= prepareSegment();
+		permit.lock();
+
+		return ready;
+	}
+
+	Segment *previous= active;
+
+	active= prepared;
+	prepared= NULL;
+	segments[active->number]= active;
+
+	if ((previous != NULL) && (previous->live == 0)) {
+		retire(previous);
+	}
+
+	// The committer gets the one after this ready
+	commitWake.notify_one();
+
+	return true;
+}
+
+void SegmentLog::retire(Segment *segment)
+{
+	// Called with the lock held, once every record in the segment has
+	// been delivered.
+
+	segments.erase(segment->number);
+
+	if (spares.size() < SPARE_SEGMENTS) {
+		spares.push_back(segment);
+	} else {
+		std::string path= segmentPath(segment->number);
+		if (unlink(path.c_str()) == -1) {
+			Log::log(LOG_ERROR,
+				"Unable to remove segment %s: %s",
+				path.c_str(), strerror(errno));
+		}
+
+		::close(segment->fd);
+		delete segment;
+	}
+}
+
+bool SegmentLog::append(MessageRef message, Location &location)
+{
+	std::unique_lock<std::mutex> permit(lock, std::defer_lock);
+
+	if (!writeRecord(message, location, permit)) {
+		return false;
+	}
+
+	bool success= awaitSync(location.sequence, permit);
+	if (!success) {
+		// The sender gets an error, so don't let the record come back
+		// after a restart if it did reach the disk after all.
+		settle(location, RECORD_DELIVERED);
+	}
+
+	return success;
+}
+
+bool SegmentLog::append(
+	std::vector<MessageRef> const &messages,
+	std::vector<Location> &locations)
+{
+	std::unique_lock<std::mutex> permit(lock, std::defer_lock);
+
+	bool written= true;
+	for (size_t i= 0; written && (i < messages.size()); i++) {
+		if (permit.owns_lock()) {
+			permit.unlock();
+		}
+
+		Location location;
+		written= writeRecord(messages[i], location, permit);
+		if (written) {
+			locations.push_back(location);
+		}
+	}
+
+	if (locations.empty()) {
+		return false;
+	}
+
+	bool success= awaitSync(locations.back().sequence, permit);
+	if (!success) {
+		for (Location const &location : locations) {
+			settle(location, RECORD_DELIVERED);
+		}
+		locations.clear();
+	}
+
+	return success && written;
+}
+
+bool SegmentLog::writeRecord(MessageRef message, Location &location,
+	std::unique_lock<std::mutex> &permit)
+{
+	// Takes the lock once the record is ready to go, and returns with it
+	// held either way
+
+	std::string host= message->getRemoteHost();
+	if (host.length() > UINT16_MAX) {
+		host.resize(UINT16_MAX);
+	}
+
+	RecordHeader header;
+	memset(&header, 0, sizeof(header));
+	header.state= RECORD_LIVE;
+	header.timestamp= message->getTimestamp();
+	header.bodyLen= message->getDataLen();
+	header.hostLen= host.length();
+
+	header.bodyCrc= Crc32::update(0, host.data(), host.length());
+	header.bodyCrc= Crc32::update(header.bodyCrc,
+		message->getData(), message->getDataLen());
+
+	uint32_t length= recordLength(header.hostLen, header.bodyLen);
+
+	static char const padding[RECORD_ALIGN]= { 0 };
+
+	struct iovec parts[4];
+	parts[0].iov_base= &header;
+	parts[0].iov_len= sizeof(header);
+	parts[1].iov_base= const_cast<char *>(host.data());
+	parts[1].iov_len= host.length();
+	parts[2].iov_base= const_cast<char *>(message->getData());
+	parts[2].iov_len= message->getDataLen();
+	parts[3].iov_base= const_cast<char *>(padding);
+	parts[3].iov_len= length - (sizeof(header) + host.length() +
+		message->getDataLen());
+
+	permit.lock();
+
+	if (active == NULL) {
+		Log::log(LOG_ERROR, "No open segment to append to");
+		return false;
+	}
+
+	// A record bigger than a whole segment still gets one to itself, the
+	// file just grows to fit it.
+
+	while ((active->size > SEGMENT_HEADER_SIZE) &&
+		(active->size + length > segmentSize))
+	{
+		if (!rotate(permit)) {
+			return false;
+		}
+	}
+
+	header.sequence= nextSequence;
+	header.headerCrc= headerCrc(active->number, header);
+
+	// On failure the write position doesn't move, so the next record
+	// lands on top of whatever part of this one made it out.
+
+	ssize_t written= pwritev(active->fd, parts, 4, active->size);
+	if (written == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to write record to segment %llu: %s",
+			(unsigned long long)active->number, strerror(errno));
+
+		return false;
+	} else if ((size_t)written != length) {
+		Log::log(LOG_ERROR,
+			"Wrong write count to segment %llu - wanted %u got %d",
+			(unsigned long long)active->number, length, (int)written);
+
+		return false;
+	}
+
+	location.segment= active->number;
+	location.offset= active->size;
+	location.sequence= nextSequence++;
+	location.length= length;
+	location.timestamp= header.timestamp;
+	location.hostHash= Fnv::hash(host.data(), host.length());
+
+	active->size+= length;
+	active->live++;
+
+	if (!active->dirty) {
+		active->dirty= true;
+		dirty.push_back(active);
+	}
+
+	return true;
+}
+
+bool SegmentLog::awaitSync(uint64_t sequence,
+	std::unique_lock<std::mutex> &permit)
+{
+	// Called with the lock held
+
+	Waiter waiter;
+	waiter.sequence= sequence;
+	waiter.done= false;
+	waiter.success= false;
+
+	waiters.push_back(&waiter);
+	commitWake.notify_one();
+
+	syncedWake.wait(permit, [&waiter] { return waiter.done; });
+
+	return waiter.success;
+}
+
+void SegmentLog::commitLoop()
+{
+	std::unique_lock<std::mutex> permit(lock);
+
+	while (committing || !waiters.empty()) {
+		if (waiters.empty()) {
+			// Quiet, so a good time to get the next segment ready
+			if (committing && (prepared == NULL) && !preparing &&
+				(active != NULL))
+			{
+				permit.unlock();
+				prepareSegment();
+				permit.lock();
+
+				if (prepared != NULL) {
+					continue;
+				}
+			}
+
+			commitWake.wait(permit);
+			continue;
+		}
+
+		if (commitDelay > 0) {
+			// Let more appends pile up behind this sync
+			permit.unlock();
+			usleep(commitDelay);
+			permit.lock();
+		}
+
+		// Everything written so far goes out with this pass
+
+		uint64_t target= nextSequence - 1;
+
+		std::vector<Segment *> syncing;
+		syncing.swap(dirty);
+		for (Segment *segment : syncing) {
+			segment->dirty= false;
+		}
+
+		// Nothing being synced can be retired in the meantime, since the
+		// appends waiting on it keep their records live.
+
+		permit.unlock();
+
+		uint64_t syncStart= Metrics::now();
+
+		bool success= true;
+		for (Segment *segment : syncing) {
+			if (fdatasync(segment->fd) == -1) {
+				Log::log(LOG_ERROR,
+					"Error in fdatasync on segment %llu: %s",
+					(unsigned long long)segment->number, strerror(errno));
+
+				success= false;
+			}
+		}
+
+		syncLatency.record(Metrics::now() - syncStart);
+
+		permit.lock();
+
+		while (!waiters.empty() && (waiters.front()->sequence <= target)) {
+			waiters.front()->done= true;
+			waiters.front()->success= success;
+			waiters.pop_front();
+		}
+
+		syncedWake.notify_all();
+	}
+}
+
+bool SegmentLog::read(Location const &location, MessageRef &message)
+{
+	Segment *segment= NULL;
+	{
+		std::lock_guard<std::mutex> permit(lock);
+
+		auto found= segments.find(location.segment);
+		if (found != segments.end()) {
+			segment= found->second;
+		}
+	}
+
+	// The segment can't be retired while this record is still live, so
+	// it's safe to use outside the lock.
+
+	bool success= false;
+
+	Location readLocation;
+	uint32_t state;
+
+	if (segment == NULL) {
+		Log::log(LOG_ERROR,
+			"Segment %llu is no longer open",
+			(unsigned long long)location.segment);
+	} else if (readRecord(segment, location.offset,
+		readLocation, state, &message))
+	{
+		success= (readLocation.sequence == location.sequence) && message;
+	}
+
+	return success;
+}
+
+void SegmentLog::setState(Segment *segment, uint64_t offset, uint32_t state)
+{
+	// Not synced - if we go down before it reaches the disk the record is
+	// just sent again, which the broker side has to tolerate anyway.
+
+	if (pwrite(segment->fd, &state, sizeof(state), offset) !=
+		sizeof(state))
+	{
+		Log::log(LOG_ERROR,
+			"Unable to update record state in segment %llu: %s",
+			(unsigned long long)segment->number, strerror(errno));
+	}
+}
+
+void SegmentLog::markDelivered(Location const &location)
+{
+	std::lock_guard<std::mutex> permit(lock);
+
+	settle(location, RECORD_DELIVERED);
+}
+
+void SegmentLog::markDelivered(std::vector<Location> const &locations)
+{
+	std::lock_guard<std::mutex> permit(lock);
+
+	for (Location const &location : locations) {
+		settle(location, RECORD_DELIVERED);
+	}
+}
+
+void SegmentLog::markQuarantined(Location const &location)
+{
+	std::lock_guard<std::mutex> permit(lock);
+
+	settle(location, RECORD_QUARANTINED);
+}
+
+void SegmentLog::settle(Location const &location, uint32_t state)
+{
+	// Called with the lock held
+
+	auto found= segments.find(location.segment);
+	if (found == segments.end()) {
+		Log::log(LOG_ERROR,
+			"Record %llu is in unknown segment %llu",
+			(unsigned long long)location.sequence,
+			(unsigned long long)location.segment);
+		return;
+	}
+
+	Segment *segment= found->second;
+	setState(segment, location.offset, state);
+
+	segment->live--;
+	if ((segment->live == 0) && (segment != active)) {
+		retire(segment);
+	}
+}
+
+void SegmentLog::close()
+{
+	if (recoverer != NULL) {
+		recoveryCancelled= true;
+
+		recoverer->join();
+		delete recoverer;
+		recoverer= NULL;
+	}
+
+	if (committer != NULL) {
+		{
+			std::lock_guard<std::mutex> permit(lock);
+			committing= false;
+			commitWake.notify_one();
+		}
+
+		committer->join();
+		delete committer;
+		committer= NULL;
+	}
+
+	std::lock_guard<std::mutex> permit(lock);
+
+	for (auto &entry : segments) {
+		::close(entry.second->fd);
+		delete entry.second;
+	}
+	segments.clear();
+
+	for (Segment *segment : spares) {
+		::close(segment->fd);
+		delete segment;
+	}
+	spares.clear();
+
+	// Comes back as an empty segment next time, and is reused from there
+	if (prepared != NULL) {
+		::close(prepared->fd);
+		delete prepared;
+		prepared= NULL;
+	}
+
+	active= NULL;
+
+	if (dirFd != -1) {
+		::close(dirFd);
+		dirFd= -1;
+	}
+}
@@ -0,0 +1,145 @@
+class Message;
+typedef std::shared_ptr<Message> MessageRef;
+
+// The SegmentLog is an append-only record log spread across a set of
+// preallocated segment files.  Each record carries the message body and its
+// metadata behind a checksummed header, so one write and one sync makes a
+// message durable.  Delivery flips a state word in the record header in
+// place, and once every record in a segment is delivered the file is kept
+// as a spare and renamed to become a later segment.
+//
+// Appends don't sync on their own.  A committer thread syncs everything
+// written since its last pass in one go and then releases all the appends
+// it covered, so the sync rate follows time rather than message count.
+
+class SegmentLog {
+public:
+	struct Location {
+		uint64_t segment;
+		uint64_t offset;
+		uint64_t sequence;
+		uint32_t length;
+
+		// When the message came in
+		int64_t timestamp;
+
+		// Groups records by sender without reading them back
+		uint32_t hostHash;
+	};
+
+	typedef std::function<void(Location const &)> RecoverFunction;
+	typedef std::function<void()> FinishFunction;
+
+	SegmentLog(char const *basePath, size_t segmentSize, int commitDelay,
+		uint64_t diskQuota, int highWater);
+	virtual ~SegmentLog();
+
+	static std::shared_ptr<SegmentLog> Create(
+		char const *basePath, size_t segmentSize, int commitDelay,
+		uint64_t diskQuota, int highWater)
+	{
+		return std::make_shared<SegmentLog>(
+			basePath, segmentSize, commitDelay, diskQuota, highWater);
+	}
+
+	// Opens a fresh segment for new records, then indexes the segments
+	// left from the last run in the background, handing every undelivered
+	// record to recovered() in the order they were written and calling
+	// finished() once they've all been handed on.
+	bool open(RecoverFunction recovered, FinishFunction finished);
+	void close();
+
+	// Only returns once the record is synced.  Fails without writing
+	// anything if the record needs a new segment and there's no room for
+	// one.
+	bool append(MessageRef message, Location &location);
+
+	// Same, but all of them wait on one sync.  Stops at the first one that
+	// can't be written, and locations only gets the ones that were synced.
+	bool append(std::vector<MessageRef> const &messages,
+		std::vector<Location> &locations);
+	bool read(Location const &location, MessageRef &message);
+	void markDelivered(Location const &location);
+	void markDelivered(std::vector<Location> const &locations);
+
+	// Takes the record out of the queue like a delivery, but leaves it
+	// marked as set aside rather than sent.
+	void markQuarantined(Location const &location);
+
+private:
+	struct Segment {
+		uint64_t number;
+		int fd;
+		uint64_t size;
+		int live;
+		bool dirty;
+	};
+
+	// An append waiting for the committer to cover its record
+	struct Waiter {
+		uint64_t sequence;
+		bool done;
+		bool success;
+	};
+
+	std::string basePath;
+	size_t segmentSize;
+	int dirFd;
+
+	std::mutex lock;
+	std::map<uint64_t, Segment *> segments;
+	std::list<Segment *> spares;
+	Segment *active;
+
+	// The next segment, set up ahead of time by the committer so appends
+	// don't wait on its syncs when the active one fills
+	Segment *prepared;
+	bool preparing;
+	std::condition_variable preparedWake;
+
+	uint64_t nextSegment;
+	uint64_t nextSequence;
+
+	// Microseconds the committer waits for more appends before syncing
+	int commitDelay;
+
+	std::thread *committer;
+	bool committing;
+	std::vector<Segment *> dirty;
+	std::deque<Waiter *> waiters;
+	std::condition_variable commitWake;
+	std::condition_variable syncedWake;
+
+	void commitLoop();
+
+	std::string segmentPath(uint64_t number);
+
+	std::thread *recoverer;
+	std::atomic<bool> recoveryCancelled;
+
+	void recoverLoop(std::vector<Segment *> pending,
+		RecoverFunction recovered, FinishFunction finished);
+	void scanSegment(Segment *segment,
+		std::vector<Location> *live, uint64_t &lastSequence, uint64_t &size);
+	bool readRecord(Segment *segment, uint64_t offset,
+		Location &location, uint32_t &state, MessageRef *message);
+
+	// Limits on new segments - 0 is no limit
+	uint64_t diskQuota;
+	int highWater;
+	bool full;
+
+	bool roomForSegment();
+	Segment *setupSegment(Segment *spare, uint64_t number);
+	bool prepareSegment();
+	bool rotate(std::unique_lock<std::mutex> &permit);
+	bool writeRecord(MessageRef message, Location &location,
+		std::unique_lock<std::mutex> &permit);
+	bool awaitSync(uint64_t sequence, std::unique_lock<std::mutex> &permit);
+	bool writeHeader(Segment *segment);
+	void retire(Segment *segment);
+	void setState(Segment *segment, uint64_t offset, uint32_t state);
+	void settle(Location const &location, uint32_t state);
+};
+
+typedef std::shared_ptr<SegmentLog> SegmentLogRef;
@@ -0,0 +1,190 @@
+#include "system.h"
+
+#include "Log.h"
+
+// Times sending to a broker with a destination and producer made for every
+// message, the way AmqServer used to, against making them once and reusing
+// them along with the message.  Meant for a broker on the same machine set
+// aside for it, so the numbers are about our side of the connection.
+
+#define DEFAULT_BROKER "tcp://127.0.0.1:61616"
+#define DEFAULT_QUEUE "mllp.bench"
+
+struct SendOptions {
+	SendOptions()
+	{
+		brokerUri= DEFAULT_BROKER;
+		user= "";
+		pass= "";
+		queueName= DEFAULT_QUEUE;
+		count= 10000;
+		size= 1024;
+	}
+
+	char const *brokerUri;
+	char const *user;
+	char const *pass;
+	char const *queueName;
+
+	// Messages sent in each run
+	long count;
+
+	// Bytes in each message
+	size_t size;
+};
+
+static uint64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sends options.count messages on a new connection and returns how many went
+// per second, or 0 if any send failed
+static double run(SendOptions const &options, bool reuse)
+{
+	double rate= 0;
+
+	std::string body(options.size, 'X');
+
+	cms::ConnectionFactory *factory=
+		new activemq::core::ActiveMQConnectionFactory(options.brokerUri);
+	cms::Connection *connection= NULL;
+	cms::Session *session= NULL;
+	cms::Destination *destination= NULL;
+	cms::MessageProducer *producer= NULL;
+	cms::TextMessage *textMessage= NULL;
+
+	try {
+		connection= factory->createConnection(options.user, options.pass);
+		session= connection->createSession(cms::Session::CLIENT_ACKNOWLEDGE);
+		connection->start();
+
+		if (reuse) {
+			destination= session->createQueue(options.queueName);
+			producer= session->createProducer(destination);
+			textMessage= session->createTextMessage();
+		}
+
+		uint64_t started= now();
+
+		for (long i= 0; i < options.count; i++) {
+			if (reuse) {
+				textMessage->clearProperties();
+				textMessage->setText(body);
+				producer->send(textMessage);
+			} else {
+				cms::Destination *sendDestination=
+					session->createQueue(options.queueName);
+				cms::MessageProducer *sendProducer=
+					session->createProducer(sendDestination);
+				cms::TextMessage *sendMessage=
+					session->createTextMessage(body);
+
+				sendProducer->send(sendMessage);
+
+				delete sendMessage;
+				delete sendProducer;
+				delete sendDestination;
+			}
+		}
+
+		double elapsed= std::max(now() - started, (uint64_t)1) / 1e6;
+		rate= options.count / elapsed;
+	} catch (const cms::CMSException &ex) {
+		std::string err= ex.getMessage();
+
+		Log::log(LOG_ERROR,
+			"CMS Exception: %s",
+			err.c_str());
+	}
+
+	try {
+		if (connection != NULL) {
+			connection->close();
+		}
+	} catch (const cms::CMSException &ex) {
+		std::string err= ex.getMessage();
+
+		Log::log(LOG_ERROR,
+			"Error closing connection: %s",
+			err.c_str());
+	}
+
+	delete textMessage;
+	delete producer;
+	delete destination;
+	delete session;
+	delete connection;
+	delete factory;
+
+	return rate;
+}
+
+int main(int argc, char* argv[])
+{
+	Log::start();
+
+	SendOptions options;
+
+	int c;
+	while ((c= getopt(argc, argv, "S:U:P:Q:n:s:")) != -1) {
+		switch (c) {
+		case 'S':
+			options.brokerUri= optarg;
+			break;
+
+		case 'U':
+			options.user= optarg;
+			break;
+
+		case 'P':
+			options.pass= optarg;
+			break;
+
+		case 'Q':
+			options.queueName= optarg;
+			break;
+
+		case 'n':
+			options.count= atol(optarg);
+			if (options.count < 1) {
+				Log::log(LOG_ERROR,
+					"Message count is invalid");
+				exit(1);
+			}
+			break;
+
+		case 's':
+			if (atol(optarg) < 1) {
+				Log::log(LOG_ERROR,
+					"Message size is invalid");
+				exit(1);
+			}
+			options.size= atol(optarg);
+			break;
+
+		default:
+			fprintf(stderr, "Unknown argument %c\n", optopt);
+			exit(1);
+		}
+	}
+
+	activemq::library::ActiveMQCPP::initializeLibrary();
+
+	double before= run(options, false);
+	double after= run(options, true);
+
+	activemq::library::ActiveMQCPP::shutdownLibrary();
+
+	if ((before == 0) || (after == 0)) {
+		return 1;
+	}
+
+	printf("Sent %ld messages of %zu bytes to %s each way:\n",
+		options.count, options.size, options.brokerUri);
+	printf("  producer per message: %10.1f msg/s\n", before);
+	printf("  reused producer:      %10.1f msg/s\n", after);
+
+	return 0;
+}
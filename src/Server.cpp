@@ -1,6 +1,9 @@
 #include "system.h"
 
 #include "Server.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
 
 Server::Server()
 {
@@ -9,3 +12,12 @@ Server::Server()
 Server::~Server()
 {
 }
+
+FrameRef Server::submit(MessageRef message,
+	std::function<void(bool success)> done)
+{
+	FrameRef frame= Frame::Create(message, done);
+	frame->complete(queue(message));
+
+	return frame;
+}
@@ -1,6 +1,8 @@
 class Message;
 typedef std::shared_ptr<Message> MessageRef;
 
+class FrameRef;
+
 class Server {
 public:
 	Server();
@@ -8,7 +10,15 @@ public:
 
 	virtual bool queue(MessageRef) = 0;
 
-	virtual void start() = 0;
+	// Hands the message on without waiting for the answer, which comes
+	// back through the frame, and through done if it's given.  Servers
+	// that can't pipeline just send it here and hand back a frame that's
+	// already complete.
+	virtual FrameRef submit(MessageRef,
+		std::function<void(bool success)> done= nullptr);
+
+	// False if it couldn't be started, which is fatal
+	virtual bool start() = 0;
 	virtual void stop() = 0;
 };
 
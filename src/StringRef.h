@@ -0,0 +1,40 @@
+// A pointer and length into someone else's buffer, for picking pieces out
+// of a message without copying them.  The buffer has to outlive it.
+
+class StringRef {
+public:
+	StringRef()
+	{
+		data= NULL;
+		length= 0;
+	}
+
+	StringRef(char const *data, size_t length)
+	{
+		this->data= data;
+		this->length= length;
+	}
+
+	char const *getData() const {
+		return data;
+	}
+	size_t getLength() const {
+		return length;
+	}
+
+	bool isEmpty() const {
+		return length == 0;
+	}
+
+	char const *find(char c) const {
+		return static_cast<char const *>(memchr(data, c, length));
+	}
+
+	void assignTo(std::string &target) const {
+		target.assign(data, length);
+	}
+
+private:
+	char const *data;
+	size_t length;
+};
@@ -1,89 +1,252 @@
 #include "system.h"
 
+#include "EventLoop.h"
 #include "Connection.h"
 #include "TcpConnection.h"
 
 #include "Log.h"
 
-TcpConnection::TcpConnection(ListenerRef listener, int sock)
+#define WRITE_TIMEOUT 10
+
+TcpConnection::TcpConnection(ListenerRef listener, EventLoopRef loop, int sock)
 	: Connection(listener)
 {
 	this->sock= sock;
+	this->loop= loop;
 
 	stopFlag= false;
 	stoppedFlag= true;
+
+	closing= false;
+	watchCount= 0;
+
+	paused= false;
+	sockParked= false;
+
+	timerFd= -1;
 }
 
 TcpConnection::~TcpConnection()
 {
 }
 
-#define READ_BUFFER_SIZE 16
+#define READ_BUFFER_MIN 4096
+#define READ_BUFFER_MAX (256 * 1024)
 
-void TcpConnection::readLoop()
+bool TcpConnection::readAvailable()
 {
-	for (bool run= true; run; ) {
-		{
-			std::lock_guard<std::mutex> permit(stopLock);
-			run= !stopFlag;
-		}
+	// Watches are edge-triggered, so keep reading until the socket runs
+	// dry or we won't hear about whatever is left.
 
-		char buffer[READ_BUFFER_SIZE];
+	bool open= true;
 
-		fd_set readFds;
-		FD_ZERO(&readFds);
-		FD_SET(sock, &readFds);
-		FD_SET(stopPipe[0], &readFds);
+	if (readBuffer.empty()) {
+		readBuffer.resize(READ_BUFFER_MIN);
+	}
 
-		int selectRval= select(
-			FD_SETSIZE, &readFds, NULL, NULL, NULL);
+	for (bool run= true; run && !paused; ) {
+		char *buffer= readBuffer.data();
+		size_t bufferSize= readBuffer.size();
 
-		if (selectRval == -1) {
-			if (errno != EINTR) {
-				Log::log(LOG_ERROR,
-					"Error in select waiting for data: %s",
+		int bufferLen= read(sock, buffer, bufferSize);
+
+		if (bufferLen < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				run= false;
+			} else if (errno != EINTR) {
+				Log::log(LOG_WARNING,
+					"Error in socket read: %s",
 					strerror(errno));
 
+				open= false;
 				run= false;
 			}
-		} else if (selectRval > 0) {
-			if (FD_ISSET(sock, &readFds)) {
-				int bufferLen= read(sock, buffer, READ_BUFFER_SIZE);
+		} else if (bufferLen == 0) {
+			open= false;
+			run= false;
+		} else if (!handleData(buffer, bufferLen)) {
+			Log::log(LOG_WARNING,
+				"Connection dropped due to protocol error");
 
-				if (bufferLen < 0) {
-					if (errno != EINTR) {
-						Log::log(LOG_WARNING,
-							"Error in socket read: %s",
-							strerror(errno));
+			open= false;
+			run= false;
+		} else if ((size_t)bufferLen == bufferSize) {
+			// Filled it, so there's probably a large message coming in
+			if (bufferSize < READ_BUFFER_MAX) {
+				readBuffer.resize(bufferSize * 2);
+			}
+		} else if ((size_t)bufferLen < (bufferSize / 8)) {
+			if (bufferSize > READ_BUFFER_MIN) {
+				readBuffer.resize(bufferSize / 2);
+				readBuffer.shrink_to_fit();
+			}
+		}
+	}
 
-						run= false;
-					}
-				} else if (bufferLen == 0) {
-					run= false;
-				} else {
-					run= handleData(buffer, bufferLen);
-					if (!run) {
-						Log::log(LOG_WARNING,
-							"Connection dropped due to protocol error");
+	return open;
+}
+
+void TcpConnection::handleEvent(int fd)
+{
+	bool last= false;
+
+	{
+		std::lock_guard<std::mutex> permit(eventLock);
+
+		if (!closing) {
+			EventLoop::Watch *watch;
+
+			if (fd == sock) {
+				watch= &sockWatch;
+				closing= !readAvailable();
+			} else if (fd == timerFd) {
+				watch= &timerWatch;
+
+				uint64_t expirations;
+				if (read(timerFd, &expirations, sizeof(expirations)) > 0) {
+					closing= !handleTimer();
+				}
+			} else {
+				watch= &stopWatch;
+
+				char junk[16];
+				while (read(stopPipe[0], junk, sizeof(junk)) > 0) {
+				}
+
+				closing= !handleWake();
+			}
+
+			if (!closing) {
+				std::lock_guard<std::mutex> stopPermit(stopLock);
+				closing= stopFlag;
+			}
+
+			if (!closing) {
+				if ((watch == &sockWatch) && paused) {
+					sockParked= true;
+				} else if (!loop->rearm(watch)) {
+					closing= true;
+				}
+			}
+
+			// Rearming picks up anything that came in while it was parked
+			if (!closing && sockParked && !paused) {
+				sockParked= false;
+				if (!loop->rearm(&sockWatch)) {
+					closing= true;
+				}
+			}
+
+			if (closing) {
+				// Kick the other watches so they fire one last time - all
+				// of them have to retire before it's safe to tear down,
+				// since the loop could be holding an event for any of them.
+
+				if (sockParked) {
+					sockParked= false;
+					if (!loop->rearm(&sockWatch)) {
+						// It's never going to fire, so it's retired already
+						watchCount--;
 					}
 				}
+
+				kick();
 			}
 		}
 
-		std::lock_guard<std::mutex> permit(stopLock);
-		if (stopFlag) {
-			run= false;
+		if (closing) {
+			last= (--watchCount == 0);
+		}
+	}
+
+	if (last) {
+		finish();
+	}
+}
+
+bool TcpConnection::handleWake()
+{
+	return true;
+}
+
+bool TcpConnection::handleTimer()
+{
+	return true;
+}
+
+void TcpConnection::pause()
+{
+	paused= true;
+}
+
+void TcpConnection::resume()
+{
+	paused= false;
+}
+
+void TcpConnection::setTimer(int timeout)
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec= timeout;
+
+	if (timerfd_settime(timerFd, 0, &spec, NULL) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to set connection timer: %s",
+			strerror(errno));
+	}
+}
+
+void TcpConnection::wake()
+{
+	std::lock_guard<std::mutex> permit(stopLock);
+
+	// The pipe is closed once it's stopped
+	if (!stoppedFlag) {
+		if (::write(stopPipe[1], "\0", 1) == -1) {
+			Log::log(LOG_ERROR,
+				"Error writing to connection stop pipe: %s",
+				strerror(errno));
 		}
 	}
+}
+
+void TcpConnection::kick()
+{
+	shutdown(sock, SHUT_RDWR);
+
+	if (::write(stopPipe[1], "\0", 1) == -1) {
+		Log::log(LOG_ERROR,
+			"Error writing to connection stop pipe: %s",
+			strerror(errno));
+	}
+
+	// Soonest it can go off
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_nsec= 1;
 
+	if (timerfd_settime(timerFd, 0, &spec, NULL) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to set connection timer: %s",
+			strerror(errno));
+	}
+}
+
+void TcpConnection::finish()
+{
 	handleEof();
 
+	loop->remove(&sockWatch);
+	loop->remove(&stopWatch);
+	loop->remove(&timerWatch);
+
 	close(sock);
 
 	// Unregister with listener
 	connectionClosed();
 
-	// Notify anyone waiting on the thread
+	// Notify anyone waiting on the connection
 	{
 		std::lock_guard<std::mutex> permit(stopLock);
 		stoppedFlag= true;
@@ -92,6 +255,7 @@ void TcpConnection::readLoop()
 
 	close(stopPipe[0]);
 	close(stopPipe[1]);
+	close(timerFd);
 
 	// Derez if this is the last reference
 	self= nullptr;
@@ -101,16 +265,48 @@ bool TcpConnection::write(char const *data, int dataLen)
 {
 	bool success= false;
 
-	int wrote= ::write(sock, data, dataLen);
-	if (wrote < 0) {
-		Log::log(LOG_ERROR,
-			"Error writing %d bytes on TCP connection: %s",
-			dataLen, strerror(errno));
-	} else if (wrote != dataLen) {
-		Log::log(LOG_ERROR,
-			"Underwrite on TCP connection");
-	} else {
-		success= true;
+	// The socket is non-blocking since it belongs to the event loop, so
+	// if the send buffer is full we have to wait it out here.
+
+	int offset= 0;
+	for (bool run= true; run; ) {
+		int wrote= ::write(sock, data + offset, dataLen - offset);
+
+		if (wrote < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				struct pollfd pollFd;
+				pollFd.fd= sock;
+				pollFd.events= POLLOUT;
+				pollFd.revents= 0;
+
+				int pollRval= poll(&pollFd, 1, WRITE_TIMEOUT * 1000);
+				if (pollRval == 0) {
+					Log::log(LOG_ERROR,
+						"Timeout writing %d bytes on TCP connection",
+						dataLen);
+
+					run= false;
+				} else if ((pollRval == -1) && (errno != EINTR)) {
+					Log::log(LOG_ERROR,
+						"Error in poll waiting to write: %s",
+						strerror(errno));
+
+					run= false;
+				}
+			} else if (errno != EINTR) {
+				Log::log(LOG_ERROR,
+					"Error writing %d bytes on TCP connection: %s",
+					dataLen, strerror(errno));
+
+				run= false;
+			}
+		} else {
+			offset+= wrote;
+			if (offset == dataLen) {
+				success= true;
+				run= false;
+			}
+		}
 	}
 
 	return success;
@@ -118,41 +314,97 @@ bool TcpConnection::write(char const *data, int dataLen)
 
 void TcpConnection::start()
 {
-	std::lock_guard<std::mutex> permit(stopLock);
-	assert(stoppedFlag);
-	stopFlag= false;
-	stoppedFlag= false;
+	{
+		std::lock_guard<std::mutex> permit(stopLock);
+		assert(stoppedFlag);
+		stopFlag= false;
+		stoppedFlag= false;
+	}
+
+	if (pipe2(stopPipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to create connection stop pipe pair: %s",
+			strerror(errno));
+	}
+
+	timerFd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (timerFd == -1) {
+		Log::log(LOG_ERROR,
+			"Unable to create connection timer: %s",
+			strerror(errno));
+	}
 
-	if (pipe(stopPipe) == -1) {
+	int flags= fcntl(sock, F_GETFL, 0);
+	if ((flags == -1) || (fcntl(sock, F_SETFL, flags|O_NONBLOCK) == -1)) {
 		Log::log(LOG_ERROR,
-			"Unable to create UDP stop pipe pair: %s",
+			"Unable to set TCP connection non-blocking: %s",
 			strerror(errno));
 	}
 
 	self= shared_from_this();
-	this->thread= std::make_shared<std::thread>(
-		&TcpConnection::readLoop, this);
 
-	this->thread->detach();
+	sockWatch.handler= this;
+	sockWatch.fd= sock;
+	stopWatch.handler= this;
+	stopWatch.fd= stopPipe[0];
+
+	timerWatch.handler= this;
+	timerWatch.fd= timerFd;
+
+	// Hold the event lock so nothing fires until all the watches are counted
+
+	bool failed= false;
+	{
+		std::lock_guard<std::mutex> permit(eventLock);
+		closing= false;
+		watchCount= 0;
+		paused= false;
+		sockParked= false;
+
+		if (loop->add(&stopWatch)) {
+			watchCount++;
+
+			if (loop->add(&timerWatch)) {
+				watchCount++;
+
+				if (loop->add(&sockWatch)) {
+					watchCount++;
+				} else {
+					closing= true;
+				}
+			} else {
+				closing= true;
+			}
+
+			if (closing) {
+				kick();
+			}
+		} else {
+			failed= true;
+		}
+	}
+
+	if (failed) {
+		finish();
+	}
 }
 
 void TcpConnection::stop()
 {
-	{
-		std::unique_lock<std::mutex> permit(stopLock);
+	std::unique_lock<std::mutex> permit(stopLock);
 
-		if (!stoppedFlag) {
-			if (!stopFlag) {
-				stopFlag= true;
-				if (::write(stopPipe[1], "\0", 1) == -1) {
-					Log::log(LOG_ERROR,
-						"Error writing to connection stop pipe: %s",
-						strerror(errno));
-				}
+	if (!stoppedFlag) {
+		if (!stopFlag) {
+			stopFlag= true;
+			if (::write(stopPipe[1], "\0", 1) == -1) {
+				Log::log(LOG_ERROR,
+					"Error writing to connection stop pipe: %s",
+					strerror(errno));
 			}
+		}
 
+		while (!stoppedFlag) {
 			stopWake.wait(permit);
 		}
 	}
 }
-
@@ -1,8 +1,9 @@
+
 class TcpConnection
-	: public Connection
+	: public Connection, public EventLoop::Handler
 {
 public:
-	TcpConnection(ListenerRef listener, int sock);
+	TcpConnection(ListenerRef listener, EventLoopRef loop, int sock);
 	virtual ~TcpConnection();
 
 	virtual void start() override;
@@ -11,7 +12,11 @@ public:
 private:
 	int sock;
 
-	std::shared_ptr<std::thread> thread;
+	EventLoopRef loop;
+	EventLoop::Watch sockWatch;
+	EventLoop::Watch stopWatch;
+	EventLoop::Watch timerWatch;
+
 	std::shared_ptr<Connection> self;
 
 	std::mutex stopLock;
@@ -20,15 +25,47 @@ private:
 	std::condition_variable stopWake;
 
 	int stopPipe[2];
+	int timerFd;
+
+	// Grows when reads keep filling it, and shrinks back down once the
+	// peer goes back to sending small messages.
+	std::vector<char> readBuffer;
+
+	// Held while servicing any of the watches, since they can fire on
+	// different loop threads at once.
+	std::mutex eventLock;
+	bool closing;
+	int watchCount;
+
+	// Paused stops reads until resume().  Parked is the socket watch
+	// having fired while paused, so it's left unarmed until then.
+	bool paused;
+	bool sockParked;
 
-	std::condition_variable stopWait;
+	virtual void handleEvent(int fd) override;
 
-	void readLoop();
+	bool readAvailable();
+	void kick();
+	void finish();
 
 protected:
 	virtual bool handleData(char const *data, int dataLen) = 0;
 	virtual void handleEof() = 0;
 
+	// Called after wake() and when the timer runs out.  False drops the
+	// connection.
+	virtual bool handleWake();
+	virtual bool handleTimer();
+
+	// These are only for use from the handlers above
+	void pause();
+	void resume();
+
+	// Timeout is in seconds, 0 to cancel it
+	void setTimer(int timeout);
+
+	// Safe from any thread, even after the connection has closed
+	void wake();
+
 	virtual bool write(char const *data, int dataLen);
 };
-
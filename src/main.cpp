@@ -1,24 +1,36 @@
 #include "system.h"
 
+#include "Message.h"
 #include "Server.h"
+#include "Futex.h"
+#include "RingQueue.h"
+#include "Frame.h"
 #include "AmqServer.h"
+#include "PoolServer.h"
+#include "SegmentLog.h"
 #include "LocalServer.h"
+#include "DedupServer.h"
 
+#include "EventLoop.h"
 #include "Listener.h"
 #include "MllpV2Listener.h"
+#include "MetricsListener.h"
 
+#include "MessageScan.h"
 #include "Log.h"
 
-static volatile bool rundown;
+static volatile sig_atomic_t rundown;
 
+// Nothing here but the flag - logging isn't safe from a signal handler
 static void doExit(int junk)
 {
-	Log::log(LOG_INFO, "Queueing exit because of signal");
 	rundown= true;
 }
 
 int main(int argc, char* argv[])
 {
+	Log::start();
+
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGTERM, doExit);
 	signal(SIGINT, doExit);
@@ -28,6 +40,10 @@ int main(int argc, char* argv[])
 
 	int mllpVersion= 2;
 	int mllpPort= 2575;
+	int eventThreads= 4;
+	int brokerConnections= 1;
+	int dedupWindow= 0;
+	int metricsPort= 0;
 
 	char const *brokerUri= getenv("AMQ_URI");
 	char const *brokerUser= getenv("AMQ_USERNAME");
@@ -36,10 +52,12 @@ int main(int argc, char* argv[])
 	char const *localQueuePath= getenv("LOCALQUEUE_PATH");
 
 	bool jsonEnvelope= false;
+	AmqServer::Options amqOptions;
+	LocalServer::Options localOptions;
 	bool peerValidation= true;
 
 	int c;
-	while ((c= getopt(argc, argv, "S:U:P:Q:L:p:ji")) != -1) {
+	while ((c= getopt(argc, argv, "S:U:P:Q:L:p:t:c:b:B:a:g:D:M:W:s:ox:wA:d:q:H:m:T:ji")) != -1) {
 		switch (c) {
 		case 'p':
 			mllpPort= atoi(optarg);
@@ -50,6 +68,192 @@ int main(int argc, char* argv[])
 			}
 			break;
 
+		case 't':
+			eventThreads= atoi(optarg);
+			if ((eventThreads < 1) || (eventThreads > 256)) {
+				Log::log(LOG_ERROR,
+					"Event thread count is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'c':
+			brokerConnections= atoi(optarg);
+			if ((brokerConnections < 1) || (brokerConnections > 64)) {
+				Log::log(LOG_ERROR,
+					"Broker connection count is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'b':
+			amqOptions.batchSize= atoi(optarg);
+			if (amqOptions.batchSize < 1) {
+				Log::log(LOG_ERROR,
+					"Batch size is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'B':
+			amqOptions.batchDelay= atoi(optarg);
+			if (amqOptions.batchDelay < 0) {
+				Log::log(LOG_ERROR,
+					"Batch delay is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'a':
+			amqOptions.asyncWindow= atoi(optarg);
+			if (amqOptions.asyncWindow < 0) {
+				Log::log(LOG_ERROR,
+					"Async window is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'g':
+			{
+				int segmentMb= atoi(optarg);
+				if ((segmentMb < 1) || (segmentMb > 1024)) {
+					Log::log(LOG_ERROR,
+						"Segment size is invalid");
+					exit(1);
+				}
+				localOptions.segmentSize= (size_t)segmentMb * 1024 * 1024;
+			}
+			break;
+
+		case 'D':
+			localOptions.commitDelay= atoi(optarg);
+			if ((localOptions.commitDelay < 0) ||
+				(localOptions.commitDelay > 1000000))
+			{
+				Log::log(LOG_ERROR,
+					"Commit delay is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'M':
+			{
+				int budgetMb= atoi(optarg);
+				if ((budgetMb < 0) || (budgetMb > 65536)) {
+					Log::log(LOG_ERROR,
+						"Memory budget is invalid");
+					exit(1);
+				}
+				localOptions.memoryBudget= (size_t)budgetMb * 1024 * 1024;
+			}
+			break;
+
+		case 'W':
+			{
+				int forwardWindow= atoi(optarg);
+				if ((forwardWindow < 1) || (forwardWindow > 4096)) {
+					Log::log(LOG_ERROR,
+						"Forward window is invalid");
+					exit(1);
+				}
+				localOptions.forwardWindow= forwardWindow;
+			}
+			break;
+
+		case 's':
+			localOptions.backlogShare= atoi(optarg);
+			if ((localOptions.backlogShare < 1) ||
+				(localOptions.backlogShare > 100))
+			{
+				Log::log(LOG_ERROR,
+					"Backlog share is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'o':
+			localOptions.strictOrdering= true;
+			break;
+
+		case 'x':
+			amqOptions.maxBackoff= atoi(optarg);
+			if ((amqOptions.maxBackoff < 1) ||
+				(amqOptions.maxBackoff > 3600))
+			{
+				Log::log(LOG_ERROR,
+					"Maximum backoff is invalid");
+				exit(1);
+			}
+			localOptions.maxBackoff= amqOptions.maxBackoff;
+			break;
+
+		case 'w':
+			amqOptions.standby= true;
+			break;
+
+		case 'A':
+			localOptions.quarantineAttempts= atoi(optarg);
+			if (localOptions.quarantineAttempts < 0) {
+				Log::log(LOG_ERROR,
+					"Quarantine attempts is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'd':
+			dedupWindow= atoi(optarg);
+			if (dedupWindow < 1) {
+				Log::log(LOG_ERROR,
+					"Duplicate window is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'q':
+			{
+				long quotaMb= atol(optarg);
+				if (quotaMb < 0) {
+					Log::log(LOG_ERROR,
+						"Disk quota is invalid");
+					exit(1);
+				}
+				localOptions.diskQuota= (uint64_t)quotaMb * 1024 * 1024;
+			}
+			break;
+
+		case 'H':
+			localOptions.highWater= atoi(optarg);
+			if ((localOptions.highWater < 0) ||
+				(localOptions.highWater > 100))
+			{
+				Log::log(LOG_ERROR,
+					"High water mark is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'm':
+			metricsPort= atoi(optarg);
+			if ((metricsPort < 1) || (metricsPort > 65535)) {
+				Log::log(LOG_ERROR,
+					"Metrics port is invalid");
+				exit(1);
+			}
+			break;
+
+		case 'T':
+			{
+				int slowThreshold= atoi(optarg);
+				if (slowThreshold < 1) {
+					Log::log(LOG_ERROR,
+						"Slow message threshold is invalid");
+					exit(1);
+				}
+
+				Message::setSlowThreshold(slowThreshold);
+			}
+			break;
+
 		case 'S':
 			brokerUri= optarg;
 			break;
@@ -84,6 +288,12 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if ((amqOptions.batchSize > 1) && (amqOptions.asyncWindow > 0)) {
+		Log::log(LOG_CRITICAL,
+			"Transacted batches and async sends can't be combined");
+		exit(1);
+	}
+
 	if (brokerUri == NULL) {
 		Log::log(LOG_CRITICAL, "Broker URI not specified");
 		exit(1);
@@ -108,39 +318,121 @@ int main(int argc, char* argv[])
 
 	// Block so everything gets de-rezzed before we shut the libs down
 	{
-   		ServerRef amqServer= AmqServer::Create(
-			brokerUri, brokerUser, brokerPass, queueName, jsonEnvelope);
-		amqServer->start();
+		ServerRef amqServer;
+		if (brokerConnections > 1) {
+			std::vector<ServerRef> workers;
+			for (int i= 0; i < brokerConnections; i++) {
+				workers.push_back(AmqServer::Create(
+					brokerUri, brokerUser, brokerPass, queueName, jsonEnvelope,
+					amqOptions));
+			}
+
+			amqServer= PoolServer::Create(workers);
+		} else {
+			amqServer= AmqServer::Create(
+				brokerUri, brokerUser, brokerPass, queueName, jsonEnvelope,
+				amqOptions);
+		}
+		if (!amqServer->start()) {
+			Log::log(LOG_CRITICAL, "Unable to start broker connection");
+			exit(1);
+		}
 
 		ServerRef server= amqServer;
 
 		ServerRef localServer;
 		if (localQueuePath != NULL) {
 			localServer= LocalServer::Create(
-				localQueuePath, amqServer);
+				localQueuePath, amqServer, localOptions);
 
-			localServer->start();
+			if (!localServer->start()) {
+				Log::log(LOG_CRITICAL, "Unable to start local queue");
+				exit(1);
+			}
 
 			server= localServer;
 		}
 
+		ServerRef dedupServer;
+		if (dedupWindow > 0) {
+			dedupServer= DedupServer::Create(
+				localQueuePath, server, dedupWindow);
+
+			if (!dedupServer->start()) {
+				Log::log(LOG_CRITICAL, "Unable to start duplicate suppression");
+				exit(1);
+			}
+
+			server= dedupServer;
+		}
+
+		Log::log(LOG_INFO, "Using %s message validation",
+			MessageScan::getImplementation());
+
+		EventLoopRef eventLoop= EventLoop::Create(eventThreads);
+		if (!eventLoop->start()) {
+			Log::log(LOG_CRITICAL, "Unable to start event loop");
+			exit(1);
+		}
+
 		ListenerRef ip4Listener=
-			MllpV2Listener::Create(AF_INET, mllpPort, server);
+			MllpV2Listener::Create(AF_INET, mllpPort, server, eventLoop);
 
 		ListenerRef ip6Listener=
-			MllpV2Listener::Create(AF_INET6, mllpPort, server);
+			MllpV2Listener::Create(AF_INET6, mllpPort, server, eventLoop);
 
 		ip4Listener->start();
 		ip6Listener->start();
 
+		// Metrics get a thread of their own, so they can still be scraped
+		// when the MLLP threads are all busy
+		EventLoopRef metricsLoop;
+		ListenerRef metricsIp4Listener;
+		ListenerRef metricsIp6Listener;
+		if (metricsPort > 0) {
+			metricsLoop= EventLoop::Create(1);
+			if (!metricsLoop->start()) {
+				Log::log(LOG_CRITICAL, "Unable to start metrics event loop");
+				exit(1);
+			}
+
+			metricsIp4Listener=
+				MetricsListener::Create(AF_INET, metricsPort, metricsLoop);
+			metricsIp6Listener=
+				MetricsListener::Create(AF_INET6, metricsPort, metricsLoop);
+
+			metricsIp4Listener->start();
+			metricsIp6Listener->start();
+		}
+
 		for (rundown= false; !rundown; ) {
 			pause();
 		}
 
+		Log::log(LOG_INFO, "Exiting because of signal");
+
 		Log::log(LOG_INFO, "Stopping Listener");
 		ip4Listener->stop();
 		ip6Listener->stop();
 
+		if (metricsPort > 0) {
+			metricsIp4Listener->stop();
+			metricsIp6Listener->stop();
+		}
+
+		// Only after the listeners, since stopping a connection needs the
+		// loop to service its stop pipe
+		Log::log(LOG_INFO, "Stopping event loop");
+		eventLoop->stop();
+
+		if (metricsLoop) {
+			metricsLoop->stop();
+		}
+
+		if (dedupServer) {
+			dedupServer->stop();
+		}
+
 		if (localServer) {
 			Log::log(LOG_INFO, "Stopping local queue");
 			localServer->stop();
@@ -167,5 +459,6 @@ int main(int argc, char* argv[])
 	ERR_free_strings();
 
 	Log::log(LOG_INFO, "Normal shutdown");
+	Log::stop();
 }
 
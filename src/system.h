@@ -19,13 +19,18 @@
 #include <cms/BytesMessage.h>
 #include <cms/MapMessage.h>
 #include <cms/ExceptionListener.h>
+#include <cms/AsyncCallback.h>
 #include <cms/MessageListener.h>
+#include <cms/MessageFormatException.h>
+#include <cms/MessageNotWriteableException.h>
 
 #include <json/reader.h>
 #include <json/value.h>
 #include <json/writer.h>
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <iostream>
 #include <fstream>
@@ -33,7 +38,17 @@
 #include <condition_variable>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <climits>
 #include <list>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <vector>
 
 #include <unistd.h>
 #include <dirent.h>
@@ -43,10 +58,18 @@
 #include <time.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <math.h>
 
 #undef LOG_EMERG